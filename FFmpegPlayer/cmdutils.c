@@ -61,7 +61,13 @@
 #endif
 #ifdef _WIN32
 #include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #endif
+#include "libavutil/time.h"
 
 
 static int init_report(const char *env);
@@ -2101,6 +2107,199 @@ double get_rotation(AVStream *st)
     return theta;
 }
 
+/* AVIO buffer of a mapped file, large reads bypass it and copy straight from the mapping */
+#define MAPPED_AVIO_BUFFER_SIZE 32768
+/* keep the address space of 32 bit builds for everything else */
+#define MAPPED_AVIO_MAX_SIZE (sizeof(void *) > 4 ? INT64_MAX : INT64_C(512) << 20)
+
+typedef struct MappedFile {
+    const uint8_t *data;
+    int64_t size;
+    int64_t pos;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+    int64_t nb_reads;   /* each one a read() syscall with the file protocol */
+    int64_t bytes_read;
+    int64_t read_time;  /* microseconds spent copying out of the mapping */
+} MappedFile;
+
+static int mapped_read(void *opaque, uint8_t *buf, int buf_size)
+{
+    MappedFile *mf = opaque;
+    int64_t start = av_gettime_relative();
+    int size = FFMIN(buf_size, mf->size - mf->pos);
+
+    if (size <= 0)
+        return AVERROR_EOF;
+    memcpy(buf, mf->data + mf->pos, size);
+    mf->pos += size;
+    mf->nb_reads++;
+    mf->bytes_read += size;
+    mf->read_time += av_gettime_relative() - start;
+    return size;
+}
+
+static int64_t mapped_seek(void *opaque, int64_t offset, int whence)
+{
+    MappedFile *mf = opaque;
+
+    switch (whence & ~AVSEEK_FORCE) {
+    case AVSEEK_SIZE:
+        return mf->size;
+    case SEEK_SET:
+        break;
+    case SEEK_CUR:
+        offset += mf->pos;
+        break;
+    case SEEK_END:
+        offset += mf->size;
+        break;
+    default:
+        return AVERROR(EINVAL);
+    }
+    if (offset < 0 || offset > mf->size)
+        return AVERROR(EINVAL);
+    mf->pos = offset;
+    return offset;
+}
+
+static void mapped_file_unmap(MappedFile *mf)
+{
+#ifdef _WIN32
+    if (mf->data)
+        UnmapViewOfFile(mf->data);
+    if (mf->mapping)
+        CloseHandle(mf->mapping);
+    if (mf->file && mf->file != INVALID_HANDLE_VALUE)
+        CloseHandle(mf->file);
+#else
+    if (mf->data)
+        munmap((void *)mf->data, mf->size);
+#endif
+    mf->data = NULL;
+}
+
+#ifdef _WIN32
+/* only fixed local disks are mapped, a page fault on a share or removable drive may stall or fail */
+static int mapped_file_local(const wchar_t *path)
+{
+    wchar_t full[MAX_PATH], root[4];
+
+    if (!GetFullPathNameW(path, MAX_PATH, full, NULL) || full[0] == L'\\' || full[1] != L':')
+        return 0;
+    root[0] = full[0];
+    root[1] = L':';
+    root[2] = L'\\';
+    root[3] = 0;
+    return GetDriveTypeW(root) == DRIVE_FIXED;
+}
+#endif
+
+static int mapped_file_map(MappedFile *mf, const char *path)
+{
+#ifdef _WIN32
+    wchar_t *wpath;
+    LARGE_INTEGER size;
+    int len = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, path, -1, NULL, 0);
+
+    if (len <= 0 || !(wpath = av_malloc_array(len, sizeof(*wpath))))
+        return AVERROR(ENOSYS);
+    MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, len);
+    if (!mapped_file_local(wpath)) {
+        av_free(wpath);
+        return AVERROR(ENOSYS);
+    }
+    mf->file = CreateFileW(wpath, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+    av_free(wpath);
+    if (mf->file == INVALID_HANDLE_VALUE || !GetFileSizeEx(mf->file, &size))
+        return AVERROR(ENOSYS);
+    mf->size = size.QuadPart;
+    if (mf->size <= 0 || mf->size > MAPPED_AVIO_MAX_SIZE)
+        return AVERROR(ENOSYS);
+    if (!(mf->mapping = CreateFileMappingW(mf->file, NULL, PAGE_READONLY, 0, 0, NULL)))
+        return AVERROR(ENOSYS);
+    if (!(mf->data = MapViewOfFile(mf->mapping, FILE_MAP_READ, 0, 0, 0)))
+        return AVERROR(ENOSYS);
+    return 0;
+#else
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY);
+
+    if (fd < 0)
+        return AVERROR(ENOSYS);
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) ||
+        st.st_size <= 0 || st.st_size > MAPPED_AVIO_MAX_SIZE) {
+        close(fd);
+        return AVERROR(ENOSYS);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    /* the mapping keeps its own reference to the file */
+    close(fd);
+    if (data == MAP_FAILED)
+        return AVERROR(ENOSYS);
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    mf->data = data;
+    mf->size = st.st_size;
+    return 0;
+#endif
+}
+
+int mapped_avio_open(AVIOContext **pb, const char *url)
+{
+    MappedFile *mf;
+    uint8_t *buffer;
+    const char *path = url;
+    int ret;
+
+    *pb = NULL;
+    av_strstart(url, "file:", &path);
+    if (strstr(path, "://") || !strcmp(path, "-"))
+        return AVERROR(ENOSYS);
+
+    if (!(mf = av_mallocz(sizeof(*mf))))
+        return AVERROR(ENOMEM);
+    if ((ret = mapped_file_map(mf, path)) < 0)
+        goto fail;
+    if (!(buffer = av_malloc(MAPPED_AVIO_BUFFER_SIZE))) {
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    if (!(*pb = avio_alloc_context(buffer, MAPPED_AVIO_BUFFER_SIZE, 0, mf, mapped_read, NULL, mapped_seek))) {
+        av_free(buffer);
+        ret = AVERROR(ENOMEM);
+        goto fail;
+    }
+    (*pb)->seekable = AVIO_SEEKABLE_NORMAL;
+    return 0;
+
+fail:
+    mapped_file_unmap(mf);
+    av_free(mf);
+    return ret;
+}
+
+void mapped_avio_close(AVIOContext **pb)
+{
+    MappedFile *mf;
+
+    if (!*pb)
+        return;
+    mf = (*pb)->opaque;
+    if (mf->bytes_read)
+        av_log(NULL, AV_LOG_VERBOSE, "mapped io: %"PRId64" bytes in %"PRId64" reads without syscalls, "
+               "%"PRId64" us copying, %.1f ms per GB\n",
+               mf->bytes_read, mf->nb_reads, mf->read_time,
+               mf->read_time / 1000.0 * (1 << 30) / mf->bytes_read);
+    mapped_file_unmap(mf);
+    av_freep(&(*pb)->buffer);
+    avio_context_free(pb);
+    av_free(mf);
+}
+
 #if CONFIG_AVDEVICE
 static int print_device_sources(AVInputFormat *fmt, AVDictionary *opts)
 {
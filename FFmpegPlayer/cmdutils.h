@@ -645,4 +645,22 @@ void *grow_array(void *array, int elem_size, int *size, int new_size);
 
 double get_rotation(AVStream *st);
 
+/**
+ * Open a local file as a memory mapped, read only AVIOContext. Reads are
+ * copied straight out of the mapping instead of going through read() calls.
+ * The caller sets it as AVFormatContext.pb together with AVFMT_FLAG_CUSTOM_IO
+ * and releases it with mapped_avio_close() after closing the input.
+ *
+ * @return 0 on success, AVERROR(ENOSYS) if url is not a local file that can
+ * be mapped (network protocols, pipes, files on shares or on anything but a
+ * fixed local disk, empty files, files larger than the address space allows) and should be opened the usual way, or another
+ * negative error code
+ */
+int mapped_avio_open(AVIOContext **pb, const char *url);
+
+/**
+ * Free a context from mapped_avio_open() and set *pb to NULL.
+ */
+void mapped_avio_close(AVIOContext **pb);
+
 #endif /* FFTOOLS_CMDUTILS_H */
@@ -32,6 +32,7 @@
 #include <limits.h>
 #include <signal.h>
 #include <stdint.h>
+#include <sys/stat.h>
 
 #include "libavutil/avstring.h"
 #include "libavutil/eval.h"
@@ -43,6 +44,7 @@
 #include "libavutil/samplefmt.h"
 #include "libavutil/avassert.h"
 #include "libavutil/time.h"
+#include "libavutil/cpu.h"
 #include "libavformat/avformat.h"
 #include "libavdevice/avdevice.h"
 #include "libswscale/swscale.h"
@@ -62,13 +64,37 @@
 
 #include <assert.h>
 
+#if !defined(HAVE_SSE2_INTRINSICS)
+#if defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2) || defined(__SSE2__)
+#define HAVE_SSE2_INTRINSICS 1
+#else
+#define HAVE_SSE2_INTRINSICS 0
+#endif
+#endif
+/* MSVC compiles AVX2 intrinsics without /arch:AVX2, they only run where the CPU reports AVX2 */
+#if !defined(HAVE_AVX2_INTRINSICS)
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define HAVE_AVX2_INTRINSICS 1
+#else
+#define HAVE_AVX2_INTRINSICS 0
+#endif
+#endif
+#if HAVE_SSE2_INTRINSICS
+#include <emmintrin.h>
+#endif
+#if HAVE_AVX2_INTRINSICS
+#include <immintrin.h>
+#endif
+
 
 
 
 const int program_birth_year = 2003;
 
-#define MAX_QUEUE_SIZE (15 * 1024 * 1024)
+/* packets taken as one second of data when a stream carries no packet durations */
 #define MIN_FRAMES 25
+/* how often read_thread retries a failed read, or checks for the end of playback after EOF */
+#define READ_THREAD_RETRY_WAIT 10
 #define EXTERNAL_CLOCK_MIN_FRAMES 2
 #define EXTERNAL_CLOCK_MAX_FRAMES 10
 
@@ -113,27 +139,316 @@ const int program_birth_year = 2003;
 
 static unsigned sws_flags = SWS_BICUBIC;
 
+/* memory budget checks: shed one more step at most this often, and relax below this share of the limit */
+#define MEM_SHED_INTERVAL 0.2
+#define MEM_RELAX_RATIO 0.8
+
+/* network files are read ahead by worker threads in chunks of READ_AHEAD_CHUNK bytes */
+#define READ_AHEAD_CHUNK (1 << 20)
+#define READ_AHEAD_MAX_THREADS 4
+/* pooled chunk buffers are freed this many seconds after the last read-ahead closed */
+#define IO_BUFFER_POOL_IDLE_TIME 30.0
+/* bucket n of the I/O latency histogram counts chunk reads under 1 << n ms, the last one the rest */
+#define IO_LATENCY_BUCKETS 16
+
+/* accurate seeks skip the non-reference pictures while still this far before the target */
+#define PREROLL_FAST_MARGIN 1.0
+
+/* keyframe index cache files start with this tag and version */
+#define KEYFRAME_INDEX_MAGIC MKTAG('K', 'F', 'I', '1')
+
+/* number of packet slots in the audio/video and subtitle rings, must be a power of two */
+#define PACKET_QUEUE_SIZE 4096
+#define SUBTITLE_PACKET_QUEUE_SIZE 256
+
+/*
+ * A reverse stash holds a whole GOP, so each GOP is decoded once, unless its pictures
+ * take more than a quarter of the memory budget, or REVERSE_STASH_MAX_BYTES without one.
+ * Past that it keeps the last REVERSE_STASH_FRAMES at least and the GOP takes several passes.
+ */
+#define REVERSE_STASH_FRAMES 30
+#define REVERSE_STASH_MAX_BYTES (512 * 1024 * 1024)
+/* seeks a reverse pass backs off by doubling steps, from one second, to find an earlier keyframe */
+#define REVERSE_SEEK_ATTEMPTS 6
+
+/* keyframes shown per second in trick play, whatever the rate */
+#define TRICK_PLAY_FPS 8
+#define TRICK_PLAY_MAX_RATE 32
+
+/* playback speed range; audio keeps its pitch through two atempo filters of 0.5 to 2 each */
+#define PLAYBACK_SPEED_MIN 0.25
+#define PLAYBACK_SPEED_MAX 4.0
+/*
+ * above normal speed the decoder skips the non-reference pictures once they would be on screen
+ * for less than SPEED_MIN_PICTURE_INTERVAL, and everything but keyframes from SPEED_KEYFRAMES_ONLY;
+ * decoded pictures still closer than the interval are dropped
+ */
+#define SPEED_MIN_PICTURE_INTERVAL 0.02
+#define SPEED_KEYFRAMES_ONLY 3.0
+
+/* urgency levels of decode steps, audio first, then video by how empty its picture queue is */
+#define DECODE_PRIORITY_LEVELS 4
+
+/* decoding workers of a thumbnail batch, and packets read after a seek looking for a keyframe */
+#define THUMBNAIL_MAX_WORKERS 8
+#define THUMBNAIL_MAX_READS 1000
+
+/* slices of a display conversion at most, and rows below which a slice is not worth a thread */
+#define CONVERT_MAX_SLICES 8
+#define CONVERT_MIN_SLICE_ROWS 64
+
+/* open decoder contexts kept between files, and how long an idle one is kept */
+#define CODEC_POOL_MAX 8
+#define CODEC_POOL_DEFAULT 4
+#define CODEC_POOL_IDLE_TIME 30.0
+
+/* external audio and subtitle inputs, addressed as stream EXTERNAL_STREAM_BASE + EXTERNAL_AUDIO/EXTERNAL_SUBTITLE */
+#define EXTERNAL_STREAM_BASE 0x10000
+#define EXTERNAL_AUDIO 0
+#define EXTERNAL_SUBTITLE 1
+#define EXTERNAL_INPUT_NB 2
+/*
+ * external subtitle files up to this size are demuxed into memory once at open,
+ * the packets are counted in the memory budget only while they are queued
+ */
+#define EXTERNAL_SUBTITLE_MEMORY_MAX (4 * 1024 * 1024)
+
+/*
+ * Demux backpressure per stream. read_thread stops reading for a stream once
+ * it is above either high mark and only resumes when it drops below both low
+ * marks. The high byte mark is also a hard cap on the memory of the queue.
+ */
+typedef struct BufferWatermarks {
+	double low_seconds;
+	double high_seconds;
+	int low_bytes;
+	int high_bytes;
+} BufferWatermarks;
+
+/* what the player memory is spent on, every allocation site reports to one of these */
+enum {
+	MEM_PACKETS,     /* compressed packets waiting for a decoder */
+	MEM_RETAINED,    /* consumed packets kept for backward seeks */
+	MEM_FRAMES,      /* decoded pictures, samples and subtitles */
+	MEM_VISUALIZER,  /* sample array and RDFT buffers */
+	MEM_TEXTURES,
+	MEM_READ_AHEAD,  /* file chunks read ahead of the demuxer */
+	MEM_NB
+};
+
+/* what is given up, in this order, while the memory budget is exceeded */
+enum {
+	MEM_SHED_NONE,
+	MEM_SHED_RETENTION,
+	MEM_SHED_FRAME_QUEUE,
+	MEM_SHED_READ_AHEAD,
+};
+
+typedef struct MemoryBudget {
+	SDL_SpinLock lock;
+	int64_t used[MEM_NB];
+	int64_t limit;              /* zero for no limit */
+	int shed_level;
+	double last_shed_change;
+} MemoryBudget;
+
+/* how much already decoded data a packet queue keeps for backward seeks, zero disables it */
+typedef struct RetentionWindow {
+	double seconds;
+	int bytes;
+} RetentionWindow;
+
 typedef struct MyAVPacketList {
 	AVPacket pkt;
-	struct MyAVPacketList *next;
 	int serial;
 } MyAVPacketList;
 
+/*
+ * Bounded single-producer/single-consumer ring. read_thread is the only
+ * producer and the decoder thread the only consumer; neither takes the mutex
+ * unless it has to sleep on an empty or full ring, or the serial changes.
+ * Indices are free running and only ever masked when addressing a slot.
+ * Every counter has exactly one writer: in_* belong to the producer, out_* to
+ * the consumer, and flush_* record the producer side at the last flush.
+ * The byte and duration counters are read by both threads, so they are
+ * atomics too and free running as well: durations are kept in time_base
+ * units modulo 2^32 and only their differences are ever looked at.
+ * retain_size and retain_duration are only used by the consumer.
+ */
 typedef struct PacketQueue {
-	MyAVPacketList *first_pkt, *last_pkt;
-	int nb_packets;
-	int size;
-	int64_t duration;
+	MyAVPacketList *pkts;
+	int max_packets;
+	SDL_atomic_t windex;
+	SDL_atomic_t rindex;
+	SDL_atomic_t tail;          /* [tail, rindex) are consumed packets kept for rewinding */
+	SDL_atomic_t flush_index;   /* slots below this index were flushed */
+	SDL_atomic_t waiting;       /* threads sleeping on cond */
+	SDL_atomic_t in_size, out_size, flush_size;
+	SDL_atomic_t in_duration, out_duration, flush_duration;
 	int abort_request;
 	int serial;
+	int out_serial;             /* serial of the last packet handed to the consumer */
+	BufferWatermarks wm;
+	AVRational time_base;       /* of the packet durations, zero if unknown */
+	SDL_atomic_t filling;       /* read_thread is refilling towards the high watermark */
+	RetentionWindow retain;
+	SDL_atomic_t retain_shed;   /* the memory budget asked to give the window up */
+	unsigned int retain_size;   /* bytes of the retained packets */
+	int64_t retain_duration;
+	SDL_atomic_t skip_pending;  /* a seek inside the queue waits for the consumer */
+	int64_t skip_target;        /* in time_base */
+	int skip_end;               /* slots below this index belong to skip_serial */
+	int skip_serial;
+	int64_t preroll_next;       /* AV_TIME_BASE target the next serial is pre-rolled to, AV_NOPTS_VALUE for none */
+	int preroll_serial;         /* the serial made with a pre-roll target, and that target */
+	int64_t preroll_target;
+	MemoryBudget *mem;
 	SDL_mutex *mutex;
 	SDL_cond *cond;
 } PacketQueue;
 
+enum {
+	CHUNK_FREE,
+	CHUNK_PENDING,   /* waiting for a worker */
+	CHUNK_READING,
+	CHUNK_READY,
+};
+
+typedef struct ReadAheadChunk {
+	int64_t offset;
+	AVBufferRef *buf;           /* from io_buffer_pool */
+	int size;                   /* bytes read, or a negative error code */
+	int state;
+	int stale;                  /* moved out of the window while a worker was reading it */
+} ReadAheadChunk;
+
+struct ReadAhead;
+
+typedef struct ReadAheadWorker {
+	struct ReadAhead *ra;
+	AVIOContext *ctx;
+	SDL_Thread *tid;
+} ReadAheadWorker;
+
+/*
+ * Keeps the window of the file after the demuxer read position in flight,
+ * each worker thread reading whole chunks through its own AVIOContext so
+ * a slow request does not hold up the others. The demuxer reads through the
+ * AVIOContext pb, whose seeks move the window and recycle the chunks outside
+ * of it; chunks a worker is still reading are dropped when it finishes.
+ */
+typedef struct ReadAhead {
+	AVIOContext *pb;
+	int64_t file_size;
+	int64_t pos;                /* read position of the demuxer */
+	ReadAheadChunk *chunks;
+	int nb_chunks;
+	int window;                 /* chunks kept in flight, fewer while the memory budget sheds the read-ahead */
+	ReadAheadWorker workers[READ_AHEAD_MAX_THREADS];
+	int nb_workers;
+	int abort;
+	int pool_user;              /* counted in the users of io_buffer_pool */
+	AVIOInterruptCB int_cb;
+	MemoryBudget *mem;
+	int64_t latency_hist[IO_LATENCY_BUCKETS];
+	SDL_mutex *mutex;
+	SDL_cond *cond;             /* a chunk changed state */
+} ReadAhead;
+
+/*
+ * The chunk buffers of all read-aheads, handed from one file to the next
+ * instead of a window of one megabyte allocations on every open and close of
+ * a network file. Like the codec pool, a reaper thread frees the buffers once
+ * no read-ahead used them for IO_BUFFER_POOL_IDLE_TIME.
+ */
+typedef struct IoBufferPool {
+	SDL_SpinLock init_lock;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	AVBufferPool *pool;
+	int users;                  /* open read-aheads */
+	int reaper;                 /* the reaper thread is running */
+	int64_t idle_since;
+	int64_t requests;
+	int64_t misses;             /* the pool had to allocate a new buffer */
+	SDL_atomic_t nb_allocated;  /* buffers alive, pooled or in use */
+	int peak_allocated;
+} IoBufferPool;
+
+typedef struct KeyframeEntry {
+	int64_t pts;                /* in the time base of the indexed stream */
+	int64_t pos;                /* byte offset of the keyframe packet */
+} KeyframeEntry;
+
+/*
+ * Byte offsets of the keyframes of one stream, for containers that cannot
+ * seek well on their own. Filled while playing or by a scan of the whole
+ * file, and kept in a cache file keyed by path, size and mtime so later
+ * sessions seek with one byte seek. Entries are sorted by pts.
+ */
+typedef struct KeyframeIndex {
+	int stream_index;           /* -1 when the file is not indexed */
+	enum AVCodecID codec_id;
+	AVRational time_base;
+	KeyframeEntry *entries;
+	int nb_entries;
+	unsigned int entries_size;
+	int complete;               /* built by a scan of the whole file */
+	int dirty;                  /* holds entries the cache file does not */
+	char *url;
+	char *cache_path;
+	uint64_t path_hash;
+	int64_t file_size;
+	int64_t file_mtime;
+	SDL_Thread *scan_tid;
+	int scan_abort;
+	SDL_mutex *mutex;
+} KeyframeIndex;
+
+typedef struct KeyframeIndexHeader {
+	uint32_t magic;
+	int32_t stream_index;
+	int32_t codec_id;
+	int32_t tb_num;
+	int32_t tb_den;
+	int32_t complete;
+	uint64_t path_hash;
+	int64_t file_size;
+	int64_t file_mtime;
+	int64_t nb_entries;
+} KeyframeIndexHeader;
+
 #define VIDEO_PICTURE_QUEUE_SIZE 3
+/* upper bound the adaptive picture queue may grow to */
+#define VIDEO_PICTURE_QUEUE_MAX 16
 #define SUBPICTURE_QUEUE_SIZE 16
 #define SAMPLE_QUEUE_SIZE 9
-#define FRAME_QUEUE_SIZE FFMAX(SAMPLE_QUEUE_SIZE, FFMAX(VIDEO_PICTURE_QUEUE_SIZE, SUBPICTURE_QUEUE_SIZE))
+
+/* weight of a new decode time sample in the running mean and variance */
+#define DECODE_TIME_AVG_COEF (1.0 / 16)
+/* frames the picture queue must look oversized for before it gives back one slot */
+#define PICTURE_QUEUE_SHRINK_FRAMES 120
+
+/* seconds of video decoding the quality governor judges at once */
+#define DECODE_QUALITY_INTERVAL 1.0
+/* share of that time spent decoding above which quality drops a step, and below which it may recover one */
+#define DECODE_QUALITY_DEGRADE 0.9
+#define DECODE_QUALITY_RECOVER 0.5
+/* calm intervals in a row before a step is recovered */
+#define DECODE_QUALITY_RECOVER_INTERVALS 3
+
+/* decode work skipped at each quality step of the governor, step 0 decodes everything */
+static const struct DecodeQuality {
+	enum AVDiscard skip_loop_filter;
+	enum AVDiscard skip_idct;
+	enum AVDiscard skip_frame;
+} decode_quality_levels[] = {
+	{ AVDISCARD_DEFAULT, AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+	{ AVDISCARD_NONREF,  AVDISCARD_DEFAULT, AVDISCARD_DEFAULT },
+	{ AVDISCARD_ALL,     AVDISCARD_NONREF,  AVDISCARD_DEFAULT },
+	{ AVDISCARD_ALL,     AVDISCARD_NONREF,  AVDISCARD_NONREF  },
+	{ AVDISCARD_ALL,     AVDISCARD_NONKEY,  AVDISCARD_NONKEY  },
+};
 
 typedef struct AudioParams {
 	int freq;
@@ -154,10 +469,18 @@ typedef struct Clock {
 	int *queue_serial;    /* pointer to the current packet queue serial, used for obsolete clock detection */
 } Clock;
 
+/* a bitmap subtitle rect in the subtitle texture format, ready to upload */
+typedef struct SubtitleBitmap {
+	uint32_t *pixels;           /* ARGB8888 */
+	int pitch;
+	int size;
+} SubtitleBitmap;
+
 /* Common struct for handling all types of decoded data and allocated render buffers. */
 typedef struct Frame {
 	AVFrame *frame;
 	AVSubtitle sub;
+	SubtitleBitmap *sub_bitmaps; /* one per rect of sub, rasterized by subtitle_thread */
 	int serial;
 	double pts;           /* presentation timestamp for the frame */
 	double duration;      /* estimated duration of the frame */
@@ -167,15 +490,25 @@ typedef struct Frame {
 	int format;
 	AVRational sar;
 	int uploaded;
+	int preloaded;        /* uploaded ahead of its display time into next_texture */
 	int flip_v;
+	int mem_size;         /* bytes of decoded data referenced by the frame */
 } Frame;
 
+/*
+ * The ring holds capacity frames but only max_size of them may be filled at
+ * a time, so max_size can be moved anywhere up to capacity while the decoder
+ * and the display are running.
+ */
 typedef struct FrameQueue {
-	Frame queue[FRAME_QUEUE_SIZE];
+	Frame *queue;
+	int capacity;
 	int rindex;
 	int windex;
 	int size;
 	int max_size;
+	int64_t mem_bytes;    /* decoded data held by the queued frames */
+	MemoryBudget *mem;
 	int keep_last;
 	int rindex_shown;
 	SDL_mutex *mutex;
@@ -189,6 +522,19 @@ enum {
 	AV_SYNC_EXTERNAL_CLOCK, /* synchronize to an external clock */
 };
 
+/*
+ * Wakes read_thread. The pending flag is set under the mutex read_thread
+ * waits with, so a wakeup sent between its checks and the wait is not lost
+ * and the thread can block without a timeout.
+ */
+typedef struct ReadWake {
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	int pending;
+	int waiting;
+	int wakeups;                /* waits that ended, for the idle wakeup statistics */
+} ReadWake;
+
 typedef struct Decoder {
 	AVPacket pkt;
 	PacketQueue *queue;
@@ -196,14 +542,172 @@ typedef struct Decoder {
 	int pkt_serial;
 	int finished;
 	int packet_pending;
-	SDL_cond *empty_queue_cond;
+	ReadWake *empty_queue_wake;
 	int64_t start_pts;
 	AVRational start_pts_tb;
 	int64_t next_pts;
 	AVRational next_pts_tb;
+	int preroll_serial;         /* frames of this serial ending before preroll_target are dropped */
+	double preroll_target;
+	int preroll_fast;           /* non-reference pictures are not decoded */
+	int preroll_frames;
+	int quality;                /* step of decode_quality_levels in use */
+	int keyframes_only;
+	enum AVDiscard speed_skip;  /* pictures not decoded for the playback speed */
+	FrameQueue *frames;
+	int slot_held;              /* runs a decode step under the decode scheduler */
+	AVCodecParameters *pool_par; /* avctx goes back to the codec pool when set, opened for these */
+	int pool_threads;
 	SDL_Thread *decoder_tid;
 } Decoder;
 
+/*
+ * Process wide admission control for decode steps, not a worker pool: every
+ * decoder of every player keeps its own thread, but at most capacity of them
+ * run a send or receive at once, and a waiting step goes before all steps of
+ * less urgent levels so the player closest to an underrun decodes first.
+ * Only the codec internal threads get fewer, split from one budget among the
+ * open video decoders. It is on for every decoder, decoder_start sets it up.
+ */
+typedef struct DecodeScheduler {
+	SDL_SpinLock init_lock;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	int capacity;               /* concurrent decode steps, 0 for one per core */
+	int busy;
+	int waiting[DECODE_PRIORITY_LEVELS];
+	int codec_threads;          /* budget of codec threads, 0 for one per core */
+	SDL_atomic_t video_decoders;
+} DecodeScheduler;
+
+typedef struct CodecPoolEntry {
+	AVCodecContext *avctx;
+	AVCodecParameters *par;     /* stream parameters it was opened for */
+	int threads;
+	int64_t idle_since;
+} CodecPoolEntry;
+
+/*
+ * Opened audio and video decoder contexts of closed streams, flushed and
+ * kept with their codec threads running, for the next stream opened with
+ * the same decoder, parameters and options. Streams opened with codec
+ * options of the user are never pooled. A reaper thread runs while the pool
+ * holds contexts and frees each one CODEC_POOL_IDLE_TIME after it came in.
+ */
+typedef struct CodecPool {
+	SDL_SpinLock init_lock;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	int reaper;                 /* the reaper thread is running */
+	int size;                   /* contexts kept at most, 0 disables the pool */
+	int nb_entries;
+	CodecPoolEntry entries[CODEC_POOL_MAX];
+	int hits;
+	int misses;
+} CodecPool;
+
+/*
+ * An audio or subtitle track from a file of its own, demuxed by its own
+ * thread into audioq or subtitleq. Its timestamps are moved by ts_offset onto
+ * the timeline of the main input. read_thread seeks it together with the
+ * main input while holding mutex, which the reader holds around each read and
+ * queue write, so the queue keeps one producer at a time.
+ */
+typedef struct ExternalInput {
+	struct VideoState *is;
+	enum AVMediaType type;
+	AVFormatContext *ic;
+	AVIOContext *mapped_pb;
+	AVStream *st;
+	PacketQueue *queue;
+	int64_t ts_offset;          /* added to every timestamp, AV_TIME_BASE units */
+	int eof;
+	AVPacket *packets;          /* the whole stream for small subtitle files, or NULL */
+	int nb_packets;
+	unsigned int packets_alloc;
+	int next_packet;
+	ReadWake wake;
+	SDL_mutex *mutex;
+	SDL_Thread *tid;
+} ExternalInput;
+
+/* decoded pictures of one GOP, in presentation order */
+typedef struct ReverseStash {
+	AVFrame **frames;
+	int nb_frames;
+	int frames_alloc;
+	int64_t mem_bytes;
+	int ready;                  /* filled, waiting for video_thread to show it backwards */
+	int eof;                    /* nothing before it, reverse playback stops here */
+} ReverseStash;
+
+/*
+ * Reverse playback. A thread with its own demuxer and decoder decodes the
+ * GOP before cursor into one stash while video_thread queues the other one
+ * to the picture queue last picture first.
+ */
+typedef struct ReversePlayer {
+	AVFormatContext *ic;
+	AVCodecContext *avctx;
+	AVStream *st;
+	AVFrame *frame;
+	ReverseStash stash[2];
+	AVCodecParameters *pool_par;
+	int pool_threads;
+	int decode_index;
+	int present_index;
+	int64_t cursor;             /* pictures from this pts on were shown already, stream time base */
+	int abort;
+	MemoryBudget *mem;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+	SDL_Thread *tid;
+} ReversePlayer;
+
+typedef struct ThumbnailJob {
+	AVPacket pkt;               /* keyframe at or before ts */
+	int64_t ts;                 /* AV_TIME_BASE units */
+	int ready;                  /* pkt was read */
+	int dup;                    /* job with the same keyframe, copied from instead of decoded, -1 if none */
+	int done;
+} ThumbnailJob;
+
+/*
+ * A batch of thumbnails of one file. The calling thread demuxes, in
+ * timestamp order, the keyframe at or before each requested time, and
+ * workers with a decoder and a scaler of their own turn the keyframes into
+ * RGBA pictures as they come.
+ */
+typedef struct ThumbnailBatch {
+	AVStream *st;
+	AVCodec *codec;
+	int lowres;
+	ThumbnailJob *jobs;
+	ThumbnailJob **order;       /* jobs by timestamp */
+	int nb_jobs;
+	int nb_read;                /* of order[] */
+	int next;                   /* next of order[] to decode */
+	int width, height;
+	unsigned char **out;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+} ThumbnailBatch;
+
+typedef struct ThumbnailWorker {
+	ThumbnailBatch *tb;
+	AVCodecContext *avctx;
+	AVFrame *frame;
+	struct SwsContext *sws;
+	SDL_Thread *tid;
+} ThumbnailWorker;
+
+/* time taken by upload_texture, per pixel format of the pictures */
+typedef struct UploadStats {
+	int count;
+	int64_t total;
+	int64_t max;
+} UploadStats;
+
 typedef struct VideoState {
 	SDL_Thread *read_tid;
 	AVInputFormat *iformat;
@@ -216,6 +720,13 @@ typedef struct VideoState {
 	int seek_flags;
 	int64_t seek_pos;
 	int64_t seek_rel;
+	int seek_count;
+	int seek_buffered_count;    /* seeks served from the queued packets */
+	int seek_indexed_count;     /* seeks done with one byte seek from the keyframe index */
+	int64_t seek_request_time;
+	int seek_display_serial;    /* picture serial whose first display ends the pending seek */
+	double seek_latency;        /* seconds from the last seek request to its first picture */
+	KeyframeIndex kf_index;
 	int read_pause_return;
 	AVFormatContext *ic;
 	int realtime;
@@ -261,6 +772,14 @@ typedef struct VideoState {
 	struct SwrContext *swr_ctx;
 	int frame_drops_early;
 	int frame_drops_late;
+	double decode_time_avg;       /* running mean of the time to decode one picture */
+	double decode_time_var;
+	int pictq_drops_seen;         /* frame_drops_late the picture queue already grew for */
+	int pictq_shrink_count;
+	double quality_window_start;  /* decode quality governor, see update_decode_quality */
+	double quality_busy;
+	int quality_calm;
+	int quality_changes;
 
 	enum ShowMode {
 		SHOW_MODE_NONE = -1, SHOW_MODE_VIDEO = 0, SHOW_MODE_WAVES, SHOW_MODE_RDFT, SHOW_MODE_NB
@@ -276,6 +795,18 @@ typedef struct VideoState {
 	SDL_Texture *vis_texture;
 	SDL_Texture *sub_texture;
 	SDL_Texture *vid_texture;
+	SDL_Texture *next_texture;  // the picture after the one on screen, uploaded before its display time
+	Frame *preload_frame;
+	int64_t upload_time;        // spent in texture uploads, microseconds
+	int64_t present_time;       // spent drawing and presenting pictures, without their uploads
+	int nb_uploads;
+	int nb_presents;
+	int nb_preloaded;           // pictures shown from a texture uploaded ahead of time
+	UploadStats upload_stats[AV_PIX_FMT_NB];
+	MemoryBudget mem;
+	AVIOContext *mapped_pb;     /* local file read through a memory mapping */
+	ReadAhead *read_ahead;      /* network file read ahead by worker threads */
+	SDL_SpinLock read_ahead_lock;   /* read_ahead is set and cleared by read_thread, stream_close aborts it */
 
 	int subtitle_stream;
 	AVStream *subtitle_st;
@@ -289,7 +820,6 @@ typedef struct VideoState {
 	PacketQueue videoq;
 	double max_frame_duration;      // maximum duration of a frame - above this, we consider the jump a timestamp discontinuity
 	struct SwsContext *img_convert_ctx;
-	struct SwsContext *sub_convert_ctx;
 	int eof;
 
 	char *filename;
@@ -303,11 +833,33 @@ typedef struct VideoState {
 	AVFilterContext *in_audio_filter;   // the first filter in the audio chain
 	AVFilterContext *out_audio_filter;  // the last filter in the audio chain
 	AVFilterGraph *agraph;              // audio filter graph
+	AVFilterContext *audio_tempo[2];    // pitch preserving tempo filters ahead of the sink, when the speed is not 1
+	double audio_tempo_speed;           // speed the tempo filters are set to
 #endif
 
 	int last_video_stream, last_audio_stream, last_subtitle_stream;
 
-	SDL_cond *continue_read_thread;
+	ExternalInput ext[EXTERNAL_INPUT_NB];
+
+	double speed;               /* media seconds per second of presentation, scales the picture durations */
+	double playback_speed;      /* set by ffplay_set_speed, trick play returns to it */
+	double speed_req;
+	double speed_last_pts;      /* last picture kept above normal speed */
+	int speed_last_serial;
+	int trick_req;
+	int trick_rate;             /* keyframe only fast forward or rewind at this rate, audio is muted */
+	int64_t trick_step;         /* media time between shown keyframes, AV_TIME_BASE units */
+	int64_t trick_last;         /* pts of the last queued keyframe */
+	int64_t trick_target;
+	int trick_seek;             /* seek to trick_target before the next read */
+	int trick_seekable;
+	int trick_done;             /* rewound to the start */
+	int reverse_req;
+	int reverse;                /* video_thread shows what the reverse player decodes, audio is muted */
+	double reverse_pos;
+	ReversePlayer rev;
+
+	ReadWake continue_read_thread;
 } VideoState;
 
 /* options specified by the user */
@@ -357,6 +909,40 @@ static char *afilters = NULL;
 #endif
 static int autorotate = 1;
 static int find_stream_info = 1;
+static int mapped_io = 1;
+static int accurate_seek = 0;
+static DecodeScheduler decode_scheduler;
+static CodecPool codec_pool = { .size = CODEC_POOL_DEFAULT };
+static IoBufferPool io_buffer_pool;
+static double thumbnail_rate = 0;
+static char *external_urls[EXTERNAL_INPUT_NB] = { NULL };
+static char *index_cache_dir = NULL;
+static int read_ahead_window = 32 * 1024 * 1024;
+static int read_ahead_threads = 2;
+/* i is an index into the fixed size table, for indices that come in through the API */
+#define TABLE_INDEX_VALID(table, i) ((i) >= 0 && (i) < (int)FF_ARRAY_ELEMS(table))
+
+/* video, audio, subtitle; subtitles never keep the reader busy on their own */
+static BufferWatermarks buffer_watermarks[3] = {
+	{ 2.0, 10.0, 16 * 1024 * 1024, 96 * 1024 * 1024 },
+	{ 1.0,  4.0,       256 * 1024,  8 * 1024 * 1024 },
+	{ 0.0,  0.0,                0,  1 * 1024 * 1024 },
+};
+
+/* picture queue grows between min and max on its own, sample queue is fixed */
+static int picture_queue_min = VIDEO_PICTURE_QUEUE_SIZE;
+static int picture_queue_max = VIDEO_PICTURE_QUEUE_MAX;
+static int sample_queue_size = SAMPLE_QUEUE_SIZE;
+
+/* video, audio, subtitle; off by default, all of audio and video must be retained to rewind */
+static RetentionWindow retention_windows[3] = {
+	{ 0.0, 0 },
+	{ 0.0, 0 },
+	{ 0.0, 0 },
+};
+
+/* bytes for the whole player, zero for no limit */
+static int64_t memory_budget = 0;
 
 static int stop_show = 0;
 
@@ -381,6 +967,20 @@ static void(*on_complete)() = NULL;
 
 static void(*on_success)() = NULL;
 
+static void(*on_decode_quality)(int level, int load) = NULL;
+
+/* a picture handed to on_video_frame, holding a reference on the decoded buffers until released */
+typedef struct VideoFrameRef {
+	FFPlayVideoFrame pub;
+	AVFrame *frame;
+} VideoFrameRef;
+
+/* set by the API thread, read by the display thread: the callback and its user change together under the lock */
+static SDL_SpinLock on_video_frame_lock;
+static void(*on_video_frame)(FFPlayVideoFrame *frame, void *user) = NULL;
+static void *on_video_frame_user = NULL;
+static int decode_quality_max = FF_ARRAY_ELEMS(decode_quality_levels) - 1;
+
 static const struct TextureFormatEntry {
 	enum AVPixelFormat format;
 	int texture_fmt;
@@ -404,6 +1004,11 @@ static const struct TextureFormatEntry {
 	{ AV_PIX_FMT_YUV420P,        SDL_PIXELFORMAT_IYUV },
 	{ AV_PIX_FMT_YUYV422,        SDL_PIXELFORMAT_YUY2 },
 	{ AV_PIX_FMT_UYVY422,        SDL_PIXELFORMAT_UYVY },
+	{ AV_PIX_FMT_NV12,           SDL_PIXELFORMAT_NV12 },
+	{ AV_PIX_FMT_NV21,           SDL_PIXELFORMAT_NV21 },
+	/* narrowed to 8 bits while uploading */
+	{ AV_PIX_FMT_YUV420P10,      SDL_PIXELFORMAT_IYUV },
+	{ AV_PIX_FMT_P010,           SDL_PIXELFORMAT_NV12 },
 	{ AV_PIX_FMT_NONE,           SDL_PIXELFORMAT_UNKNOWN },
 };
 
@@ -445,32 +1050,168 @@ int64_t get_valid_channel_layout(int64_t channel_layout, int channels)
 		return 0;
 }
 
+static void mem_account(MemoryBudget *mem, int category, int64_t bytes)
+{
+	if (!mem)
+		return;
+	SDL_AtomicLock(&mem->lock);
+	mem->used[category] += bytes;
+	SDL_AtomicUnlock(&mem->lock);
+}
+
+static void mem_move(MemoryBudget *mem, int from, int to, int64_t bytes)
+{
+	if (!mem)
+		return;
+	SDL_AtomicLock(&mem->lock);
+	mem->used[from] -= bytes;
+	mem->used[to] += bytes;
+	SDL_AtomicUnlock(&mem->lock);
+}
+
+/* bytes of one category, or of all of them for a negative category */
+static int64_t mem_used(MemoryBudget *mem, int category)
+{
+	int64_t used = 0;
+	int i;
+
+	SDL_AtomicLock(&mem->lock);
+	if (category >= 0)
+		used = mem->used[category];
+	else
+		for (i = 0; i < MEM_NB; i++)
+			used += mem->used[i];
+	SDL_AtomicUnlock(&mem->lock);
+	return used;
+}
+
+static int packet_queue_full(PacketQueue *q)
+{
+	return (unsigned)SDL_AtomicGet(&q->windex) - (unsigned)SDL_AtomicGet(&q->tail) >= (unsigned)q->max_packets;
+}
+
+/* number of packets of the current serial, flushed slots still waiting to be released are not counted */
+static int packet_queue_nb_packets(PacketQueue *q)
+{
+	int rindex = SDL_AtomicGet(&q->rindex);
+	int flush_index = SDL_AtomicGet(&q->flush_index);
+	int windex = SDL_AtomicGet(&q->windex);
+	if ((int)((unsigned)flush_index - (unsigned)rindex) > 0)
+		rindex = flush_index;
+	return FFMAX((int)((unsigned)windex - (unsigned)rindex), 0);
+}
+
+/* what is in between the producer counter in and the later of the consumer counter out and the flush mark */
+static int packet_queue_counter_diff(SDL_atomic_t *in, SDL_atomic_t *out, SDL_atomic_t *flush)
+{
+	unsigned int out_value = SDL_AtomicGet(out);
+	unsigned int flush_value = SDL_AtomicGet(flush);
+	if ((int)(flush_value - out_value) > 0)
+		out_value = flush_value;
+	return FFMAX((int)((unsigned)SDL_AtomicGet(in) - out_value), 0);
+}
+
+static int packet_queue_size(PacketQueue *q)
+{
+	return packet_queue_counter_diff(&q->in_size, &q->out_size, &q->flush_size);
+}
+
+static int64_t packet_queue_duration(PacketQueue *q)
+{
+	return packet_queue_counter_diff(&q->in_duration, &q->out_duration, &q->flush_duration);
+}
+
+/* queued seconds, estimated from the packet count if the packets carry no duration */
+static double packet_queue_seconds(PacketQueue *q)
+{
+	int64_t duration = packet_queue_duration(q);
+	if (duration && q->time_base.num && q->time_base.den)
+		return duration * av_q2d(q->time_base);
+	return (double)packet_queue_nb_packets(q) / MIN_FRAMES;
+}
+
+static int packet_queue_above_high(PacketQueue *q)
+{
+	return packet_queue_full(q) ||
+		packet_queue_size(q) >= q->wm.high_bytes ||
+		packet_queue_seconds(q) >= q->wm.high_seconds;
+}
+
+static int packet_queue_below_low(PacketQueue *q)
+{
+	return packet_queue_size(q) < q->wm.low_bytes &&
+		packet_queue_seconds(q) < q->wm.low_seconds;
+}
+
+static void packet_queue_wake(PacketQueue *q)
+{
+	if (SDL_AtomicGet(&q->waiting)) {
+		SDL_LockMutex(q->mutex);
+		SDL_CondSignal(q->cond);
+		SDL_UnlockMutex(q->mutex);
+	}
+}
+
+/* with the mutex held: move to a new serial, which takes the pre-roll target set for it */
+static void packet_queue_next_serial(PacketQueue *q)
+{
+	q->serial++;
+	q->preroll_serial = q->preroll_next != AV_NOPTS_VALUE ? q->serial : -1;
+	q->preroll_target = q->preroll_next;
+	q->preroll_next = AV_NOPTS_VALUE;
+}
+
+/*
+ * Producer side: the decoder drops what ends before target from the serial
+ * the next flush or skip makes, AV_NOPTS_VALUE to cancel. Set before the
+ * serial moves, the decoder finds the target with the flush packet.
+ */
+static void packet_queue_set_preroll(PacketQueue *q, int64_t target)
+{
+	SDL_LockMutex(q->mutex);
+	q->preroll_next = target;
+	SDL_UnlockMutex(q->mutex);
+}
+
 static int packet_queue_put_private(PacketQueue *q, AVPacket *pkt)
 {
 	MyAVPacketList *pkt1;
+	int windex;
 
 	if (q->abort_request)
 		return -1;
 
-	pkt1 = av_malloc(sizeof(MyAVPacketList));
-	if (!pkt1)
-		return -1;
+	if (pkt == &flush_pkt) {
+		/* the consumer turns a serial change into a flush packet, so it never takes a slot */
+		SDL_LockMutex(q->mutex);
+		packet_queue_next_serial(q);
+		SDL_CondSignal(q->cond);
+		SDL_UnlockMutex(q->mutex);
+		return 0;
+	}
+
+	if (packet_queue_full(q)) {
+		SDL_LockMutex(q->mutex);
+		SDL_AtomicIncRef(&q->waiting);
+		while (packet_queue_full(q) && !q->abort_request)
+			SDL_CondWait(q->cond, q->mutex);
+		SDL_AtomicDecRef(&q->waiting);
+		SDL_UnlockMutex(q->mutex);
+		if (q->abort_request)
+			return -1;
+	}
+
+	windex = SDL_AtomicGet(&q->windex);
+	pkt1 = &q->pkts[windex & (q->max_packets - 1)];
 	pkt1->pkt = *pkt;
-	pkt1->next = NULL;
-	if (pkt == &flush_pkt)
-		q->serial++;
 	pkt1->serial = q->serial;
-
-	if (!q->last_pkt)
-		q->first_pkt = pkt1;
-	else
-		q->last_pkt->next = pkt1;
-	q->last_pkt = pkt1;
-	q->nb_packets++;
-	q->size += pkt1->pkt.size + sizeof(*pkt1);
-	q->duration += pkt1->pkt.duration;
+	SDL_AtomicAdd(&q->in_size, (int)(pkt1->pkt.size + sizeof(*pkt1)));
+	SDL_AtomicAdd(&q->in_duration, (int)pkt1->pkt.duration);
+	mem_account(q->mem, MEM_PACKETS, pkt1->pkt.size + sizeof(*pkt1));
 	/* XXX: should duplicate packet data in DV case */
-	SDL_CondSignal(q->cond);
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&q->windex, (int)((unsigned)windex + 1));
+	packet_queue_wake(q);
 	return 0;
 }
 
@@ -478,9 +1219,7 @@ static int packet_queue_put(PacketQueue *q, AVPacket *pkt)
 {
 	int ret;
 
-	SDL_LockMutex(q->mutex);
 	ret = packet_queue_put_private(q, pkt);
-	SDL_UnlockMutex(q->mutex);
 
 	if (pkt != &flush_pkt && ret < 0)
 		av_packet_unref(pkt);
@@ -499,9 +1238,22 @@ static int packet_queue_put_nullpacket(PacketQueue *q, int stream_index)
 }
 
 /* packet queue handling */
-static int packet_queue_init(PacketQueue *q)
+static int packet_queue_init(PacketQueue *q, int max_packets, const BufferWatermarks *wm, const RetentionWindow *retain, MemoryBudget *mem)
 {
 	memset(q, 0, sizeof(PacketQueue));
+	q->wm = *wm;
+	q->retain = *retain;
+	q->mem = mem;
+	q->preroll_next = AV_NOPTS_VALUE;
+	q->preroll_serial = -1;
+	SDL_AtomicSet(&q->filling, 1);
+	av_assert0(max_packets > 0 && !(max_packets & (max_packets - 1)));
+	q->pkts = av_mallocz_array(max_packets, sizeof(*q->pkts));
+	if (!q->pkts) {
+		av_log(NULL, AV_LOG_FATAL, "Could not allocate packet queue.\n");
+		return AVERROR(ENOMEM);
+	}
+	q->max_packets = max_packets;
 	q->mutex = SDL_CreateMutex();
 	if (!q->mutex) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
@@ -516,27 +1268,222 @@ static int packet_queue_init(PacketQueue *q)
 	return 0;
 }
 
-static void packet_queue_flush(PacketQueue *q)
+static int packet_queue_retaining(PacketQueue *q)
+{
+	return !SDL_AtomicGet(&q->retain_shed) && (q->retain.seconds > 0 || q->retain.bytes > 0);
+}
+
+/*
+ * Consumer side: free retained slots from the tail while the window is over
+ * its limits, holds flushed packets, or does not start on a keyframe.
+ * The retained part never takes more than half of the ring, so the producer
+ * always has room to read ahead. The producer may still be looking at the
+ * timestamps, so only the payload of a slot is cleared.
+ */
+static void packet_queue_trim(PacketQueue *q, int drop_all)
+{
+	unsigned int tail = SDL_AtomicGet(&q->tail);
+	unsigned int rindex = SDL_AtomicGet(&q->rindex);
+	unsigned int flush_index = SDL_AtomicGet(&q->flush_index);
+	double retain_seconds = q->retain.seconds;
+	int retain_bytes = q->retain.bytes;
+	AVRational tb = q->time_base;
+
+	if (tail == rindex)
+		return;
+	while (tail != rindex) {
+		MyAVPacketList *pkt1 = &q->pkts[tail & (q->max_packets - 1)];
+		AVPacket pkt;
+
+		if (!drop_all && packet_queue_retaining(q) &&
+			(int)(flush_index - tail) <= 0 &&
+			(pkt1->pkt.flags & AV_PKT_FLAG_KEY) &&
+			rindex - tail <= (unsigned)q->max_packets / 2 &&
+			(!retain_bytes || q->retain_size <= (unsigned)retain_bytes) &&
+			(!retain_seconds || !tb.num || q->retain_duration * av_q2d(tb) <= retain_seconds))
+			break;
+		q->retain_size -= pkt1->pkt.size + sizeof(*pkt1);
+		q->retain_duration -= pkt1->pkt.duration;
+		mem_account(q->mem, MEM_RETAINED, -(int64_t)(pkt1->pkt.size + sizeof(*pkt1)));
+		pkt = pkt1->pkt;
+		av_packet_unref(&pkt);
+		pkt1->pkt.buf = NULL;
+		pkt1->pkt.data = NULL;
+		pkt1->pkt.size = 0;
+		pkt1->pkt.side_data = NULL;
+		pkt1->pkt.side_data_elems = 0;
+		tail++;
+	}
+	SDL_AtomicSet(&q->tail, tail);
+	packet_queue_wake(q);
+}
+
+/* consumer side: move the slot at rindex behind the read position, the packet stays in the slot */
+static void packet_queue_advance(PacketQueue *q, MyAVPacketList *pkt1)
+{
+	SDL_AtomicAdd(&q->out_size, (int)(pkt1->pkt.size + sizeof(*pkt1)));
+	SDL_AtomicAdd(&q->out_duration, (int)pkt1->pkt.duration);
+	q->retain_size += pkt1->pkt.size + sizeof(*pkt1);
+	q->retain_duration += pkt1->pkt.duration;
+	mem_move(q->mem, MEM_PACKETS, MEM_RETAINED, pkt1->pkt.size + sizeof(*pkt1));
+	SDL_AtomicSet(&q->rindex, (int)((unsigned)SDL_AtomicGet(&q->rindex) + 1));
+	packet_queue_trim(q, 0);
+}
+
+static int64_t packet_ts(AVPacket *pkt)
+{
+	return pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+}
+
+/*
+ * Producer side: check that the queued and retained packets hold a keyframe
+ * at or before target and reach at least up to it. Slot contents are only
+ * ever written by the producer, so reading them while the consumer advances
+ * is safe.
+ */
+static int packet_queue_covers(PacketQueue *q, int64_t target)
 {
-	MyAVPacketList *pkt, *pkt1;
+	unsigned int i = SDL_AtomicGet(&q->tail);
+	unsigned int flush_index = SDL_AtomicGet(&q->flush_index);
+	unsigned int windex = SDL_AtomicGet(&q->windex);
+	int has_key = 0;
+
+	if ((int)(flush_index - i) > 0)
+		i = flush_index;
+	for (; (int)(windex - i) > 0; i++) {
+		AVPacket *pkt = &q->pkts[i & (q->max_packets - 1)].pkt;
+		int64_t ts = packet_ts(pkt);
+		if (ts == AV_NOPTS_VALUE)
+			continue;
+		if (ts >= target)
+			return has_key;
+		if (pkt->flags & AV_PKT_FLAG_KEY)
+			has_key = 1;
+	}
+	return 0;
+}
 
+/*
+ * Producer side: restart the consumer at the last keyframe at or before
+ * target without touching the demuxer. The consumer applies it the next time
+ * it looks at the queue, see packet_queue_apply_skip.
+ */
+static void packet_queue_skip(PacketQueue *q, int64_t target)
+{
 	SDL_LockMutex(q->mutex);
-	for (pkt = q->first_pkt; pkt; pkt = pkt1) {
-		pkt1 = pkt->next;
-		av_packet_unref(&pkt->pkt);
-		av_freep(&pkt);
-	}
-	q->last_pkt = NULL;
-	q->first_pkt = NULL;
-	q->nb_packets = 0;
-	q->size = 0;
-	q->duration = 0;
+	q->skip_target = target;
+	q->skip_end = SDL_AtomicGet(&q->windex);
+	q->skip_serial = q->serial + 1;
+	/* set before the serial moves so a consumer seeing the new serial finds the skip too */
+	SDL_AtomicSet(&q->skip_pending, 1);
+	packet_queue_next_serial(q);
+	SDL_CondSignal(q->cond);
 	SDL_UnlockMutex(q->mutex);
 }
 
-static void packet_queue_destroy(PacketQueue *q)
+/*
+ * Consumer side: move the read position to the skip keyframe, forward by
+ * retiring the slots in between, or backward into the retained packets, and
+ * give everything from there on the new serial.
+ */
+static void packet_queue_apply_skip(PacketQueue *q)
+{
+	unsigned int i, key, start, end;
+	int64_t target;
+	int serial, found = 0;
+
+	SDL_LockMutex(q->mutex);
+	target = q->skip_target;
+	end = q->skip_end;
+	serial = q->skip_serial;
+	SDL_AtomicSet(&q->skip_pending, 0);
+	SDL_UnlockMutex(q->mutex);
+
+	start = SDL_AtomicGet(&q->tail);
+	if ((int)((unsigned)SDL_AtomicGet(&q->flush_index) - start) > 0)
+		start = SDL_AtomicGet(&q->flush_index);
+	if ((int)(end - start) <= 0)
+		return;
+
+	/* last keyframe at or before target, else the first one after it */
+	key = start;
+	for (i = start; (int)(end - i) > 0; i++) {
+		AVPacket *pkt = &q->pkts[i & (q->max_packets - 1)].pkt;
+		int64_t ts = packet_ts(pkt);
+		if (!(pkt->flags & AV_PKT_FLAG_KEY) || ts == AV_NOPTS_VALUE)
+			continue;
+		if (ts > target && found)
+			break;
+		key = i;
+		found = 1;
+		if (ts >= target)
+			break;
+	}
+
+	for (i = SDL_AtomicGet(&q->rindex); (int)(i - key) > 0; i--) {
+		MyAVPacketList *pkt1 = &q->pkts[(i - 1) & (q->max_packets - 1)];
+		SDL_AtomicAdd(&q->out_size, -(int)(pkt1->pkt.size + sizeof(*pkt1)));
+		SDL_AtomicAdd(&q->out_duration, -(int)pkt1->pkt.duration);
+		q->retain_size -= pkt1->pkt.size + sizeof(*pkt1);
+		q->retain_duration -= pkt1->pkt.duration;
+		mem_move(q->mem, MEM_RETAINED, MEM_PACKETS, pkt1->pkt.size + sizeof(*pkt1));
+	}
+	if ((int)((unsigned)SDL_AtomicGet(&q->rindex) - key) > 0)
+		SDL_AtomicSet(&q->rindex, key);
+	while ((unsigned)SDL_AtomicGet(&q->rindex) != key)
+		packet_queue_advance(q, &q->pkts[SDL_AtomicGet(&q->rindex) & (q->max_packets - 1)]);
+	for (i = key; (int)(end - i) > 0; i++)
+		q->pkts[i & (q->max_packets - 1)].serial = serial;
+}
+
+/* consumer side: return the oldest live slot, releasing flushed ones on the way */
+static MyAVPacketList *packet_queue_peek(PacketQueue *q)
+{
+	for (;;) {
+		int rindex = SDL_AtomicGet(&q->rindex);
+		MyAVPacketList *pkt1;
+
+		if (SDL_AtomicGet(&q->skip_pending)) {
+			packet_queue_apply_skip(q);
+			continue;
+		}
+		if (rindex == SDL_AtomicGet(&q->windex))
+			return NULL;
+		SDL_MemoryBarrierAcquire();
+		pkt1 = &q->pkts[rindex & (q->max_packets - 1)];
+		if ((int)((unsigned)SDL_AtomicGet(&q->flush_index) - (unsigned)rindex) <= 0)
+			return pkt1;
+		packet_queue_advance(q, pkt1);
+	}
+}
+
+/*
+ * Drop everything queued so far. The consumer may be reading the ring at the
+ * same time, so the producer only moves flush_index and the consumer releases
+ * the stale packets the next time it looks at the queue.
+ */
+static void packet_queue_flush(PacketQueue *q)
+{
+	SDL_AtomicSet(&q->flush_size, SDL_AtomicGet(&q->in_size));
+	SDL_AtomicSet(&q->flush_duration, SDL_AtomicGet(&q->in_duration));
+	SDL_MemoryBarrierRelease();
+	SDL_AtomicSet(&q->flush_index, SDL_AtomicGet(&q->windex));
+}
+
+/* release all queued packets, only valid while no consumer thread is running */
+static void packet_queue_release(PacketQueue *q)
 {
+	/* with everything flushed, peeking releases the whole ring */
 	packet_queue_flush(q);
+	packet_queue_peek(q);
+	packet_queue_trim(q, 1);
+}
+
+static void packet_queue_destroy(PacketQueue *q)
+{
+	if (q->pkts)
+		packet_queue_release(q);
+	av_freep(&q->pkts);
 	SDL_DestroyMutex(q->mutex);
 	SDL_DestroyCond(q->cond);
 }
@@ -556,8 +1503,8 @@ static void packet_queue_start(PacketQueue *q)
 {
 	SDL_LockMutex(q->mutex);
 	q->abort_request = 0;
-	packet_queue_put_private(q, &flush_pkt);
 	SDL_UnlockMutex(q->mutex);
+	packet_queue_put_private(q, &flush_pkt);
 }
 
 /* return < 0 if aborted, 0 if no packet and > 0 if packet.  */
@@ -566,26 +1513,38 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *seria
 	MyAVPacketList *pkt1;
 	int ret;
 
-	SDL_LockMutex(q->mutex);
-
 	for (;;) {
 		if (q->abort_request) {
 			ret = -1;
 			break;
 		}
 
-		pkt1 = q->first_pkt;
-		if (pkt1) {
-			q->first_pkt = pkt1->next;
-			if (!q->first_pkt)
-				q->last_pkt = NULL;
-			q->nb_packets--;
-			q->size -= pkt1->pkt.size + sizeof(*pkt1);
-			q->duration -= pkt1->pkt.duration;
-			*pkt = pkt1->pkt;
+		pkt1 = packet_queue_peek(q);
+		if (pkt1 ? pkt1->serial != q->out_serial : q->serial != q->out_serial) {
+			/* first packet of a new serial, hand out the flush packet before it */
+			q->out_serial = pkt1 ? pkt1->serial : q->serial;
+			*pkt = flush_pkt;
+			if (serial)
+				*serial = q->out_serial;
+			ret = 1;
+			break;
+		}
+		else if (pkt1) {
+			int drop_retained = 0;
+			/* a retained packet stays referenced by its slot, the decoder gets its own reference */
+			if (!packet_queue_retaining(q) || !pkt1->pkt.buf ||
+				(drop_retained = av_packet_ref(pkt, &pkt1->pkt) < 0)) {
+				*pkt = pkt1->pkt;
+				pkt1->pkt.buf = NULL;
+				pkt1->pkt.side_data = NULL;
+				pkt1->pkt.side_data_elems = 0;
+			}
 			if (serial)
 				*serial = pkt1->serial;
-			av_free(pkt1);
+			packet_queue_advance(q, pkt1);
+			/* the slot lost its packet, nothing before it can be replayed any more */
+			if (drop_retained)
+				packet_queue_trim(q, 1);
 			ret = 1;
 			break;
 		}
@@ -594,42 +1553,791 @@ static int packet_queue_get(PacketQueue *q, AVPacket *pkt, int block, int *seria
 			break;
 		}
 		else {
-			SDL_CondWait(q->cond, q->mutex);
+			SDL_LockMutex(q->mutex);
+			SDL_AtomicIncRef(&q->waiting);
+			while (!q->abort_request && q->serial == q->out_serial &&
+				SDL_AtomicGet(&q->rindex) == SDL_AtomicGet(&q->windex))
+				SDL_CondWait(q->cond, q->mutex);
+			SDL_AtomicDecRef(&q->waiting);
+			SDL_UnlockMutex(q->mutex);
 		}
 	}
-	SDL_UnlockMutex(q->mutex);
 	return ret;
 }
 
-static void decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue, SDL_cond *empty_queue_cond) {
-	memset(d, 0, sizeof(Decoder));
-	d->avctx = avctx;
-	d->queue = queue;
-	d->empty_queue_cond = empty_queue_cond;
-	d->start_pts = AV_NOPTS_VALUE;
-	d->pkt_serial = -1;
+static int io_buffer_pool_init(IoBufferPool *ip)
+{
+	int ret = 0;
+
+	SDL_AtomicLock(&ip->init_lock);
+	if ((!ip->mutex && !(ip->mutex = SDL_CreateMutex())) ||
+		(!ip->cond && !(ip->cond = SDL_CreateCond())))
+		ret = AVERROR(ENOMEM);
+	SDL_AtomicUnlock(&ip->init_lock);
+	return ret;
 }
 
-static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
-	int ret = AVERROR(EAGAIN);
+static void io_buffer_free(void *opaque, uint8_t *data)
+{
+	IoBufferPool *ip = opaque;
 
-	for (;;) {
-		AVPacket pkt;
+	SDL_AtomicAdd(&ip->nb_allocated, -1);
+	av_free(data);
+}
 
-		if (d->queue->serial == d->pkt_serial) {
-			do {
-				if (d->queue->abort_request)
-					return -1;
+/* called by av_buffer_pool_get with ip->mutex held */
+static AVBufferRef *io_buffer_alloc(void *opaque, int size)
+{
+	IoBufferPool *ip = opaque;
+	AVBufferRef *buf;
+	uint8_t *data;
 
-				switch (d->avctx->codec_type) {
-				case AVMEDIA_TYPE_VIDEO:
-					ret = avcodec_receive_frame(d->avctx, frame);
-					if (ret >= 0) {
-						if (decoder_reorder_pts == -1) {
-							frame->pts = frame->best_effort_timestamp;
-						}
-						else if (!decoder_reorder_pts) {
-							frame->pts = frame->pkt_dts;
+	if (!(data = av_malloc(size)))
+		return NULL;
+	if (!(buf = av_buffer_create(data, size, io_buffer_free, ip, 0))) {
+		av_free(data);
+		return NULL;
+	}
+	ip->misses++;
+	ip->peak_allocated = FFMAX(ip->peak_allocated, SDL_AtomicAdd(&ip->nb_allocated, 1) + 1);
+	return buf;
+}
+
+/* free the pooled buffers once nobody took one for IO_BUFFER_POOL_IDLE_TIME, give up when a read-ahead opens */
+static int io_buffer_pool_reaper(void *arg)
+{
+	IoBufferPool *ip = arg;
+	int64_t wait;
+
+	SDL_LockMutex(ip->mutex);
+	while (ip->pool && !ip->users) {
+		wait = ip->idle_since + (int64_t)(IO_BUFFER_POOL_IDLE_TIME * AV_TIME_BASE) - av_gettime_relative();
+		if (wait > 0)
+			SDL_CondWaitTimeout(ip->cond, ip->mutex, (Uint32)(wait / 1000) + 1);
+		else
+			av_buffer_pool_uninit(&ip->pool);
+	}
+	ip->reaper = 0;
+	SDL_UnlockMutex(ip->mutex);
+	return 0;
+}
+
+static int io_buffer_pool_open(IoBufferPool *ip)
+{
+	if (io_buffer_pool_init(ip) < 0)
+		return AVERROR(ENOMEM);
+	SDL_LockMutex(ip->mutex);
+	ip->users++;
+	SDL_CondSignal(ip->cond);
+	SDL_UnlockMutex(ip->mutex);
+	return 0;
+}
+
+/* a buffer of READ_AHEAD_CHUNK bytes, only between io_buffer_pool_open and io_buffer_pool_close */
+static AVBufferRef *io_buffer_pool_get(IoBufferPool *ip)
+{
+	AVBufferRef *buf = NULL;
+
+	SDL_LockMutex(ip->mutex);
+	if (!ip->pool)
+		ip->pool = av_buffer_pool_init2(READ_AHEAD_CHUNK, ip, io_buffer_alloc, NULL);
+	if (ip->pool && (buf = av_buffer_pool_get(ip->pool)))
+		ip->requests++;
+	SDL_UnlockMutex(ip->mutex);
+	return buf;
+}
+
+/* after every buffer of the read-ahead went back to the pool */
+static void io_buffer_pool_close(IoBufferPool *ip)
+{
+	SDL_LockMutex(ip->mutex);
+	if (!--ip->users && ip->pool) {
+		ip->idle_since = av_gettime_relative();
+		if (!ip->reaper) {
+			SDL_Thread *tid = SDL_CreateThread(io_buffer_pool_reaper, "io_buffer_pool", ip);
+			if (tid) {
+				ip->reaper = 1;
+				SDL_DetachThread(tid);
+			}
+			else {
+				av_buffer_pool_uninit(&ip->pool);
+			}
+		}
+	}
+	SDL_UnlockMutex(ip->mutex);
+}
+
+/* UNC paths and mapped network drives, where every read may stall for a round trip */
+static int is_network_path(const char *path)
+{
+#ifdef _WIN32
+	char root[4];
+
+	av_strstart(path, "file:", &path);
+	if ((path[0] == '\\' || path[0] == '/') && (path[1] == '\\' || path[1] == '/'))
+		return 1;
+	if (av_toupper(path[0]) >= 'A' && av_toupper(path[0]) <= 'Z' && path[1] == ':') {
+		snprintf(root, sizeof(root), "%c:\\", path[0]);
+		return GetDriveTypeA(root) == DRIVE_REMOTE;
+	}
+#endif
+	return 0;
+}
+
+/*
+ * Move the window to the demuxer position: queue the missing chunks on the
+ * chunks that fell out of it. Only window chunks hold a buffer, the buffers
+ * of free chunks above that go back to the pool.
+ */
+static void read_ahead_schedule(ReadAhead *ra)
+{
+	int64_t base = ra->pos - ra->pos % READ_AHEAD_CHUNK;
+	int64_t end = FFMIN(base + (int64_t)ra->window * READ_AHEAD_CHUNK, ra->file_size);
+	int64_t offset;
+	int i, j, nb_buffers = 0;
+
+	for (i = 0; i < ra->nb_chunks; i++) {
+		ReadAheadChunk *c = &ra->chunks[i];
+		if (c->state != CHUNK_FREE && (c->offset < base || c->offset >= end)) {
+			if (c->state == CHUNK_READING)
+				c->stale = 1;
+			else
+				c->state = CHUNK_FREE;
+		}
+		nb_buffers += !!c->buf;
+	}
+	for (i = 0; i < ra->nb_chunks && nb_buffers > ra->window; i++) {
+		if (ra->chunks[i].state == CHUNK_FREE && ra->chunks[i].buf) {
+			av_buffer_unref(&ra->chunks[i].buf);
+			mem_account(ra->mem, MEM_READ_AHEAD, -READ_AHEAD_CHUNK);
+			nb_buffers--;
+		}
+	}
+	for (offset = base; offset < end; offset += READ_AHEAD_CHUNK) {
+		for (i = 0; i < ra->nb_chunks; i++)
+			if (ra->chunks[i].state != CHUNK_FREE && !ra->chunks[i].stale && ra->chunks[i].offset == offset)
+				break;
+		if (i < ra->nb_chunks)
+			continue;
+		for (j = 0; j < ra->nb_chunks && ra->chunks[j].state != CHUNK_FREE; j++)
+			;
+		if (j == ra->nb_chunks)
+			break;
+		if (!ra->chunks[j].buf) {
+			if (!(ra->chunks[j].buf = io_buffer_pool_get(&io_buffer_pool)))
+				break;
+			mem_account(ra->mem, MEM_READ_AHEAD, READ_AHEAD_CHUNK);
+		}
+		ra->chunks[j].offset = offset;
+		ra->chunks[j].state = CHUNK_PENDING;
+	}
+	SDL_CondBroadcast(ra->cond);
+}
+
+static int read_ahead_thread(void *arg)
+{
+	ReadAheadWorker *w = arg;
+	ReadAhead *ra = w->ra;
+
+	SDL_LockMutex(ra->mutex);
+	while (!ra->abort) {
+		ReadAheadChunk *c = NULL;
+		int64_t start, latency, pos;
+		int i, size;
+
+		/* the lowest pending offset is the one the demuxer needs first */
+		for (i = 0; i < ra->nb_chunks; i++)
+			if (ra->chunks[i].state == CHUNK_PENDING && (!c || ra->chunks[i].offset < c->offset))
+				c = &ra->chunks[i];
+		if (!c) {
+			SDL_CondWait(ra->cond, ra->mutex);
+			continue;
+		}
+		c->state = CHUNK_READING;
+		SDL_UnlockMutex(ra->mutex);
+
+		start = av_gettime_relative();
+		pos = avio_seek(w->ctx, c->offset, SEEK_SET);
+		if (pos >= 0) {
+			size = avio_read(w->ctx, c->buf->data, READ_AHEAD_CHUNK);
+			if (size == AVERROR_EOF)
+				size = 0;
+		}
+		else {
+			size = (int)pos;
+		}
+		latency = (av_gettime_relative() - start) / 1000;
+
+		SDL_LockMutex(ra->mutex);
+		ra->latency_hist[latency < 1 ? 0 : FFMIN(av_log2(latency) + 1, IO_LATENCY_BUCKETS - 1)]++;
+		if (c->stale) {
+			c->stale = 0;
+			c->state = CHUNK_FREE;
+			read_ahead_schedule(ra);
+		}
+		else {
+			c->size = size;
+			c->state = CHUNK_READY;
+			SDL_CondBroadcast(ra->cond);
+		}
+	}
+	SDL_UnlockMutex(ra->mutex);
+	return 0;
+}
+
+static int read_ahead_read(void *opaque, uint8_t *buf, int buf_size)
+{
+	ReadAhead *ra = opaque;
+	int ret, scheduled = 0;
+
+	SDL_LockMutex(ra->mutex);
+	for (;;) {
+		ReadAheadChunk *c = NULL;
+		int64_t offset = ra->pos - ra->pos % READ_AHEAD_CHUNK;
+		int i;
+
+		if (ra->pos >= ra->file_size) {
+			ret = AVERROR_EOF;
+			break;
+		}
+		if (ra->abort || (ra->int_cb.callback && ra->int_cb.callback(ra->int_cb.opaque))) {
+			ret = AVERROR_EXIT;
+			break;
+		}
+		for (i = 0; i < ra->nb_chunks; i++)
+			if (ra->chunks[i].state != CHUNK_FREE && !ra->chunks[i].stale && ra->chunks[i].offset == offset)
+				c = &ra->chunks[i];
+		if (!c) {
+			if (!scheduled++) {
+				read_ahead_schedule(ra);
+				continue;
+			}
+			/* the workers reschedule once a chunk read for an old position comes back */
+			for (i = 0; i < ra->nb_chunks && ra->chunks[i].state != CHUNK_READING; i++)
+				;
+			if (i == ra->nb_chunks) {
+				/* no buffer for the chunk and nothing in flight to free one */
+				ret = AVERROR(ENOMEM);
+				break;
+			}
+			SDL_CondWait(ra->cond, ra->mutex);
+			continue;
+		}
+		if (c->state != CHUNK_READY) {
+			SDL_CondWait(ra->cond, ra->mutex);
+			continue;
+		}
+		if (c->size < 0) {
+			ret = c->size;
+			/* let a later read try again */
+			c->state = CHUNK_PENDING;
+			SDL_CondBroadcast(ra->cond);
+			break;
+		}
+		ret = (int)FFMIN(buf_size, c->offset + c->size - ra->pos);
+		if (ret <= 0) {
+			ret = AVERROR_EOF;
+			break;
+		}
+		memcpy(buf, c->buf->data + (ra->pos - c->offset), ret);
+		ra->pos += ret;
+		if (ra->pos >= c->offset + READ_AHEAD_CHUNK)
+			read_ahead_schedule(ra);
+		break;
+	}
+	SDL_UnlockMutex(ra->mutex);
+	return ret;
+}
+
+static int64_t read_ahead_seek(void *opaque, int64_t offset, int whence)
+{
+	ReadAhead *ra = opaque;
+
+	switch (whence & ~AVSEEK_FORCE) {
+	case AVSEEK_SIZE:
+		return ra->file_size;
+	case SEEK_SET:
+		break;
+	case SEEK_CUR:
+		offset += ra->pos;
+		break;
+	case SEEK_END:
+		offset += ra->file_size;
+		break;
+	default:
+		return AVERROR(EINVAL);
+	}
+	if (offset < 0)
+		return AVERROR(EINVAL);
+
+	SDL_LockMutex(ra->mutex);
+	ra->pos = offset;
+	read_ahead_schedule(ra);
+	SDL_UnlockMutex(ra->mutex);
+	return offset;
+}
+
+static void read_ahead_close(ReadAhead **pra)
+{
+	ReadAhead *ra = *pra;
+	int i;
+
+	if (!ra)
+		return;
+	if (ra->mutex) {
+		SDL_LockMutex(ra->mutex);
+		ra->abort = 1;
+		SDL_CondBroadcast(ra->cond);
+		SDL_UnlockMutex(ra->mutex);
+	}
+	for (i = 0; i < ra->nb_workers; i++) {
+		if (ra->workers[i].tid)
+			SDL_WaitThread(ra->workers[i].tid, NULL);
+		avio_closep(&ra->workers[i].ctx);
+	}
+	for (i = 0; ra->chunks && i < ra->nb_chunks; i++) {
+		if (ra->chunks[i].buf)
+			mem_account(ra->mem, MEM_READ_AHEAD, -READ_AHEAD_CHUNK);
+		av_buffer_unref(&ra->chunks[i].buf);
+	}
+	av_free(ra->chunks);
+	if (ra->pool_user)
+		io_buffer_pool_close(&io_buffer_pool);
+	if (ra->pb) {
+		av_freep(&ra->pb->buffer);
+		avio_context_free(&ra->pb);
+	}
+	SDL_DestroyCond(ra->cond);
+	SDL_DestroyMutex(ra->mutex);
+	av_freep(pra);
+}
+
+static int read_ahead_open(ReadAhead **pra, const char *url, const AVIOInterruptCB *int_cb, MemoryBudget *mem)
+{
+	ReadAhead *ra;
+	uint8_t *buffer;
+	int i;
+
+	if (!(ra = *pra = av_mallocz(sizeof(*ra))))
+		return AVERROR(ENOMEM);
+	ra->int_cb = *int_cb;
+	ra->mem = mem;
+	ra->nb_workers = av_clip(read_ahead_threads, 1, READ_AHEAD_MAX_THREADS);
+	/* a chunk is always free for the demuxer position, even with every worker on a stale read */
+	ra->nb_chunks = FFMAX(read_ahead_window / READ_AHEAD_CHUNK, ra->nb_workers + 1);
+	if (!(ra->mutex = SDL_CreateMutex()) || !(ra->cond = SDL_CreateCond()) ||
+		!(ra->chunks = av_mallocz_array(ra->nb_chunks, sizeof(*ra->chunks))))
+		goto fail;
+	if (io_buffer_pool_open(&io_buffer_pool) < 0)
+		goto fail;
+	ra->pool_user = 1;
+	ra->window = ra->nb_chunks;
+
+	for (i = 0; i < ra->nb_workers; i++) {
+		ra->workers[i].ra = ra;
+		if (avio_open2(&ra->workers[i].ctx, url, AVIO_FLAG_READ, int_cb, NULL) < 0)
+			goto fail;
+	}
+	ra->file_size = avio_size(ra->workers[0].ctx);
+	if (ra->file_size <= 0 || !(ra->workers[0].ctx->seekable & AVIO_SEEKABLE_NORMAL))
+		goto fail;
+
+	if (!(buffer = av_malloc(READ_AHEAD_CHUNK)))
+		goto fail;
+	if (!(ra->pb = avio_alloc_context(buffer, READ_AHEAD_CHUNK, 0, ra, read_ahead_read, NULL, read_ahead_seek))) {
+		av_free(buffer);
+		goto fail;
+	}
+	ra->pb->seekable = AVIO_SEEKABLE_NORMAL;
+
+	read_ahead_schedule(ra);
+	for (i = 0; i < ra->nb_workers; i++)
+		if (!(ra->workers[i].tid = SDL_CreateThread(read_ahead_thread, "read_ahead", &ra->workers[i])))
+			goto fail;
+	return 0;
+
+fail:
+	read_ahead_close(pra);
+	return AVERROR(ENOSYS);
+}
+
+/* fail the read the demuxer is blocked in, read_ahead_close still has to join the workers */
+static void read_ahead_abort(ReadAhead *ra)
+{
+	SDL_LockMutex(ra->mutex);
+	ra->abort = 1;
+	SDL_CondBroadcast(ra->cond);
+	SDL_UnlockMutex(ra->mutex);
+}
+
+/* down to the chunks the workers and the demuxer need at least, with shed set */
+static void read_ahead_shed(ReadAhead *ra, int shed)
+{
+	SDL_LockMutex(ra->mutex);
+	ra->window = shed ? ra->nb_workers + 1 : ra->nb_chunks;
+	read_ahead_schedule(ra);
+	SDL_UnlockMutex(ra->mutex);
+}
+
+static int read_wake_init(ReadWake *w)
+{
+	w->pending = 0;
+	w->waiting = 0;
+	w->wakeups = 0;
+	if (!(w->mutex = SDL_CreateMutex()))
+		return AVERROR(ENOMEM);
+	if (!(w->cond = SDL_CreateCond())) {
+		SDL_DestroyMutex(w->mutex);
+		w->mutex = NULL;
+		return AVERROR(ENOMEM);
+	}
+	return 0;
+}
+
+static void read_wake_destroy(ReadWake *w)
+{
+	SDL_DestroyCond(w->cond);
+	SDL_DestroyMutex(w->mutex);
+	w->cond = NULL;
+	w->mutex = NULL;
+}
+
+static void read_wake_signal(ReadWake *w)
+{
+	if (!w->mutex)
+		return;
+	SDL_LockMutex(w->mutex);
+	w->pending = 1;
+	if (w->waiting)
+		SDL_CondSignal(w->cond);
+	SDL_UnlockMutex(w->mutex);
+}
+
+/* block until read_wake_signal, or at most timeout ms when timeout is not negative */
+static void read_wake_wait(ReadWake *w, int timeout)
+{
+	SDL_LockMutex(w->mutex);
+	if (!w->pending) {
+		w->waiting = 1;
+		if (timeout < 0)
+			SDL_CondWait(w->cond, w->mutex);
+		else
+			SDL_CondWaitTimeout(w->cond, w->mutex, timeout);
+		w->waiting = 0;
+		w->wakeups++;
+	}
+	w->pending = 0;
+	SDL_UnlockMutex(w->mutex);
+}
+
+static int decode_scheduler_init(DecodeScheduler *ds)
+{
+	int ret = 0;
+
+	SDL_AtomicLock(&ds->init_lock);
+	if (!ds->mutex) {
+		ds->cond = SDL_CreateCond();
+		ds->mutex = SDL_CreateMutex();
+		if (!ds->mutex || !ds->cond) {
+			SDL_DestroyCond(ds->cond);
+			SDL_DestroyMutex(ds->mutex);
+			ds->cond = NULL;
+			ds->mutex = NULL;
+			ret = AVERROR(ENOMEM);
+		}
+	}
+	SDL_AtomicUnlock(&ds->init_lock);
+	return ret;
+}
+
+/* codec threads for a new decoder, its share of the budget left by the open video decoders */
+static int decode_scheduler_codec_threads(DecodeScheduler *ds, enum AVMediaType type)
+{
+	int budget = ds->codec_threads > 0 ? ds->codec_threads : SDL_GetCPUCount();
+
+	if (type != AVMEDIA_TYPE_VIDEO)
+		return 1;
+	return FFMAX(budget / (SDL_AtomicGet(&ds->video_decoders) + 1), 1);
+}
+
+static int decoder_priority(Decoder *d)
+{
+	FrameQueue *f = d->frames;
+
+	if (d->avctx->codec_type == AVMEDIA_TYPE_AUDIO)
+		return 0;
+	if (!f || f->max_size <= 0)
+		return DECODE_PRIORITY_LEVELS - 1;
+	return 1 + FFMIN(f->size * (DECODE_PRIORITY_LEVELS - 1) / f->max_size, DECODE_PRIORITY_LEVELS - 2);
+}
+
+static void decode_slot_acquire(Decoder *d)
+{
+	DecodeScheduler *ds = &decode_scheduler;
+	int level, capacity, blocked, i;
+
+	/* no mutex only when decoder_start could not create it and warned */
+	if (!ds->mutex || d->avctx->codec_type == AVMEDIA_TYPE_SUBTITLE)
+		return;
+	level = decoder_priority(d);
+	SDL_LockMutex(ds->mutex);
+	ds->waiting[level]++;
+	for (;;) {
+		capacity = ds->capacity > 0 ? ds->capacity : SDL_GetCPUCount();
+		blocked = ds->busy >= capacity;
+		for (i = 0; i < level && !blocked; i++)
+			blocked = ds->waiting[i] > 0;
+		if (!blocked || d->queue->abort_request)
+			break;
+		SDL_CondWait(ds->cond, ds->mutex);
+	}
+	ds->waiting[level]--;
+	ds->busy++;
+	SDL_UnlockMutex(ds->mutex);
+	d->slot_held = 1;
+}
+
+static void decode_slot_release(Decoder *d)
+{
+	DecodeScheduler *ds = &decode_scheduler;
+
+	if (!d->slot_held)
+		return;
+	SDL_LockMutex(ds->mutex);
+	ds->busy--;
+	SDL_CondBroadcast(ds->cond);
+	SDL_UnlockMutex(ds->mutex);
+	d->slot_held = 0;
+}
+
+static int codec_pool_init(CodecPool *cp)
+{
+	int ret = 0;
+
+	SDL_AtomicLock(&cp->init_lock);
+	if ((!cp->mutex && !(cp->mutex = SDL_CreateMutex())) ||
+		(!cp->cond && !(cp->cond = SDL_CreateCond())))
+		ret = AVERROR(ENOMEM);
+	SDL_AtomicUnlock(&cp->init_lock);
+	return ret;
+}
+
+/* the stream parameters a decoder may read from its context, a pooled context is not given them again */
+static int codec_pool_match(const AVCodecParameters *a, const AVCodecParameters *b)
+{
+	return a->codec_type == b->codec_type && a->codec_id == b->codec_id && a->codec_tag == b->codec_tag &&
+		a->format == b->format && a->profile == b->profile && a->level == b->level &&
+		a->bits_per_raw_sample == b->bits_per_raw_sample &&
+		a->width == b->width && a->height == b->height &&
+		!av_cmp_q(a->sample_aspect_ratio, b->sample_aspect_ratio) && a->field_order == b->field_order &&
+		a->color_range == b->color_range && a->color_primaries == b->color_primaries &&
+		a->color_trc == b->color_trc && a->color_space == b->color_space &&
+		a->chroma_location == b->chroma_location && a->video_delay == b->video_delay &&
+		a->sample_rate == b->sample_rate && a->channels == b->channels && a->channel_layout == b->channel_layout &&
+		a->block_align == b->block_align && a->frame_size == b->frame_size &&
+		a->initial_padding == b->initial_padding && a->trailing_padding == b->trailing_padding &&
+		a->seek_preroll == b->seek_preroll && a->bits_per_coded_sample == b->bits_per_coded_sample &&
+		a->extradata_size == b->extradata_size &&
+		(!a->extradata_size || !memcmp(a->extradata, b->extradata, a->extradata_size));
+}
+
+static void codec_pool_remove(CodecPool *cp, int i)
+{
+	CodecPoolEntry *e = &cp->entries[i];
+
+	avcodec_free_context(&e->avctx);
+	avcodec_parameters_free(&e->par);
+	memmove(e, e + 1, (cp->nb_entries - i - 1) * sizeof(*e));
+	cp->nb_entries--;
+}
+
+/* drop the contexts idle for too long, and the oldest ones above keep */
+static void codec_pool_trim(CodecPool *cp, int keep)
+{
+	int64_t now = av_gettime_relative();
+	int i;
+
+	for (i = cp->nb_entries - 1; i >= 0; i--)
+		if (now - cp->entries[i].idle_since >= CODEC_POOL_IDLE_TIME * AV_TIME_BASE)
+			codec_pool_remove(cp, i);
+	while (cp->nb_entries > FFMAX(keep, 0))
+		codec_pool_remove(cp, 0);
+}
+
+/* sleep until the oldest context is due, the pool may sit untouched between files */
+static int codec_pool_reaper(void *arg)
+{
+	CodecPool *cp = arg;
+	int64_t wait;
+
+	SDL_LockMutex(cp->mutex);
+	while (cp->nb_entries > 0) {
+		wait = cp->entries[0].idle_since + (int64_t)(CODEC_POOL_IDLE_TIME * AV_TIME_BASE) - av_gettime_relative();
+		if (wait > 0)
+			SDL_CondWaitTimeout(cp->cond, cp->mutex, (Uint32)(wait / 1000) + 1);
+		codec_pool_trim(cp, cp->size);
+	}
+	cp->reaper = 0;
+	SDL_UnlockMutex(cp->mutex);
+	return 0;
+}
+
+/* an idle context opened by codec for the same stream parameters and options, NULL if there is none */
+static AVCodecContext *codec_pool_get(CodecPool *cp, const AVCodec *codec, const AVCodecParameters *par,
+	int threads, int lowres, int flags2)
+{
+	AVCodecContext *avctx = NULL;
+	int i;
+
+	if (codec_pool_init(cp) < 0)
+		return NULL;
+	SDL_LockMutex(cp->mutex);
+	codec_pool_trim(cp, cp->size);
+	for (i = cp->nb_entries - 1; i >= 0; i--) {
+		CodecPoolEntry *e = &cp->entries[i];
+		if (e->avctx->codec == codec && e->threads == threads && e->avctx->lowres == lowres &&
+			e->avctx->flags2 == flags2 && codec_pool_match(e->par, par)) {
+			avctx = e->avctx;
+			e->avctx = NULL;
+			codec_pool_remove(cp, i);
+			break;
+		}
+	}
+	if (avctx)
+		cp->hits++;
+	else
+		cp->misses++;
+	SDL_UnlockMutex(cp->mutex);
+	return avctx;
+}
+
+/* flush the context and keep it for the next stream, or free it when the pool is off */
+static void codec_pool_put(CodecPool *cp, AVCodecContext **avctx, AVCodecParameters **par, int threads)
+{
+	CodecPoolEntry *e;
+
+	if (!*avctx || !*par || !avcodec_is_open(*avctx) || codec_pool_init(cp) < 0)
+		goto free;
+	SDL_LockMutex(cp->mutex);
+	codec_pool_trim(cp, cp->size - 1);
+	if (cp->size > 0) {
+		avcodec_flush_buffers(*avctx);
+		(*avctx)->skip_frame = AVDISCARD_DEFAULT;
+		(*avctx)->skip_idct = AVDISCARD_DEFAULT;
+		(*avctx)->skip_loop_filter = AVDISCARD_DEFAULT;
+		e = &cp->entries[cp->nb_entries++];
+		e->avctx = *avctx;
+		e->par = *par;
+		e->threads = threads;
+		e->idle_since = av_gettime_relative();
+		*avctx = NULL;
+		*par = NULL;
+		if (!cp->reaper) {
+			SDL_Thread *tid = SDL_CreateThread(codec_pool_reaper, "codec_pool", cp);
+			if (tid) {
+				cp->reaper = 1;
+				SDL_DetachThread(tid);
+			}
+		}
+	}
+	SDL_UnlockMutex(cp->mutex);
+free:
+	avcodec_free_context(avctx);
+	avcodec_parameters_free(par);
+}
+
+static void decoder_init(Decoder *d, AVCodecContext *avctx, PacketQueue *queue, FrameQueue *frames, ReadWake *empty_queue_wake) {
+	memset(d, 0, sizeof(Decoder));
+	d->avctx = avctx;
+	d->queue = queue;
+	d->frames = frames;
+	d->empty_queue_wake = empty_queue_wake;
+	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO)
+		SDL_AtomicAdd(&decode_scheduler.video_decoders, 1);
+	d->start_pts = AV_NOPTS_VALUE;
+	d->pkt_serial = -1;
+	d->preroll_serial = -1;
+}
+
+/* apply the quality step, raised to skip the non-reference pictures during a fast pre-roll */
+static void decoder_update_discard(Decoder *d)
+{
+	const struct DecodeQuality *q = &decode_quality_levels[d->quality];
+	enum AVDiscard preroll = d->preroll_fast ? AVDISCARD_NONREF : AVDISCARD_DEFAULT;
+
+	d->avctx->skip_loop_filter = FFMAX(q->skip_loop_filter, preroll);
+	d->avctx->skip_idct = q->skip_idct;
+	d->avctx->skip_frame = FFMAX(FFMAX(q->skip_frame, preroll), d->keyframes_only ? AVDISCARD_NONKEY : d->speed_skip);
+}
+
+static void decoder_set_fast(Decoder *d, int fast)
+{
+	/* skipping the loop filter of reference pictures would corrupt the target, only drop what nothing refers to */
+	if (d->preroll_fast == fast || d->avctx->codec_type != AVMEDIA_TYPE_VIDEO)
+		return;
+	d->preroll_fast = fast;
+	decoder_update_discard(d);
+}
+
+/* return 1 for a decoded frame of an accurate seek that ends before the seek target, in seconds */
+static int decoder_preroll_drop(Decoder *d, double start, double end)
+{
+	if (d->pkt_serial != d->preroll_serial) {
+		decoder_set_fast(d, 0);
+		return 0;
+	}
+	if (isnan(start) || end > d->preroll_target) {
+		av_log(NULL, AV_LOG_DEBUG, "accurate seek dropped %d %s frames\n",
+			d->preroll_frames, av_get_media_type_string(d->avctx->codec_type));
+		d->preroll_serial = -1;
+		decoder_set_fast(d, 0);
+		return 0;
+	}
+	decoder_set_fast(d, start < d->preroll_target - PREROLL_FAST_MARGIN);
+	d->preroll_frames++;
+	return 1;
+}
+
+/* with the flush packet of a new serial: pre-roll it if the seek that made it was an accurate one */
+static void decoder_start_preroll(Decoder *d)
+{
+	PacketQueue *q = d->queue;
+
+	SDL_LockMutex(q->mutex);
+	if (q->preroll_serial == d->pkt_serial) {
+		d->preroll_target = q->preroll_target / (double)AV_TIME_BASE;
+		d->preroll_frames = 0;
+		d->preroll_serial = d->pkt_serial;
+	}
+	else {
+		d->preroll_serial = -1;
+	}
+	SDL_UnlockMutex(q->mutex);
+}
+
+static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
+	int ret = AVERROR(EAGAIN);
+
+	for (;;) {
+		AVPacket pkt;
+
+		if (d->queue->serial == d->pkt_serial) {
+			decode_slot_acquire(d);
+			do {
+				if (d->queue->abort_request) {
+					decode_slot_release(d);
+					return -1;
+				}
+
+				switch (d->avctx->codec_type) {
+				case AVMEDIA_TYPE_VIDEO:
+					ret = avcodec_receive_frame(d->avctx, frame);
+					if (ret >= 0) {
+						if (decoder_reorder_pts == -1) {
+							frame->pts = frame->best_effort_timestamp;
+						}
+						else if (!decoder_reorder_pts) {
+							frame->pts = frame->pkt_dts;
 						}
 					}
 					break;
@@ -651,16 +2359,21 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
 				if (ret == AVERROR_EOF) {
 					d->finished = d->pkt_serial;
 					avcodec_flush_buffers(d->avctx);
+					decode_slot_release(d);
 					return 0;
 				}
-				if (ret >= 0)
+				if (ret >= 0) {
+					decode_slot_release(d);
 					return 1;
+				}
 			} while (ret != AVERROR(EAGAIN));
+			decode_slot_release(d);
 		}
 
 		do {
-			if (d->queue->nb_packets == 0)
-				SDL_CondSignal(d->empty_queue_cond);
+			if (packet_queue_nb_packets(d->queue) == 0 ||
+				(!SDL_AtomicGet(&d->queue->filling) && packet_queue_below_low(d->queue)))
+				read_wake_signal(d->empty_queue_wake);
 			if (d->packet_pending) {
 				av_packet_move_ref(&pkt, &d->pkt);
 				d->packet_pending = 0;
@@ -676,6 +2389,7 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
 			d->finished = 0;
 			d->next_pts = d->start_pts;
 			d->next_pts_tb = d->start_pts_tb;
+			decoder_start_preroll(d);
 		}
 		else {
 			if (d->avctx->codec_type == AVMEDIA_TYPE_SUBTITLE) {
@@ -693,7 +2407,10 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
 				}
 			}
 			else {
-				if (avcodec_send_packet(d->avctx, &pkt) == AVERROR(EAGAIN)) {
+				decode_slot_acquire(d);
+				ret = avcodec_send_packet(d->avctx, &pkt);
+				decode_slot_release(d);
+				if (ret == AVERROR(EAGAIN)) {
 					av_log(d->avctx, AV_LOG_ERROR, "Receive_frame and send_packet both returned EAGAIN, which is an API violation.\n");
 					d->packet_pending = 1;
 					av_packet_move_ref(&d->pkt, &pkt);
@@ -705,20 +2422,34 @@ static int decoder_decode_frame(Decoder *d, AVFrame *frame, AVSubtitle *sub) {
 }
 
 static void decoder_destroy(Decoder *d) {
+	if (d->avctx && d->avctx->codec_type == AVMEDIA_TYPE_VIDEO)
+		SDL_AtomicAdd(&decode_scheduler.video_decoders, -1);
 	av_packet_unref(&d->pkt);
-	avcodec_free_context(&d->avctx);
+	codec_pool_put(&codec_pool, &d->avctx, &d->pool_par, d->pool_threads);
 }
 
 static void frame_queue_unref_item(Frame *vp)
 {
+	int i;
+
+	if (vp->sub_bitmaps)
+		for (i = 0; i < vp->sub.num_rects; i++)
+			av_free(vp->sub_bitmaps[i].pixels);
+	av_freep(&vp->sub_bitmaps);
 	av_frame_unref(vp->frame);
 	avsubtitle_free(&vp->sub);
 }
 
-static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int keep_last)
+static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int capacity, int keep_last, MemoryBudget *mem)
 {
 	int i;
 	memset(f, 0, sizeof(FrameQueue));
+	f->mem = mem;
+	f->capacity = FFMAX(capacity, 1);
+	if (!(f->queue = av_mallocz_array(f->capacity, sizeof(*f->queue)))) {
+		av_log(NULL, AV_LOG_FATAL, "Could not allocate frame queue.\n");
+		return AVERROR(ENOMEM);
+	}
 	if (!(f->mutex = SDL_CreateMutex())) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
 		return AVERROR(ENOMEM);
@@ -728,9 +2459,9 @@ static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int
 		return AVERROR(ENOMEM);
 	}
 	f->pktq = pktq;
-	f->max_size = FFMIN(max_size, FRAME_QUEUE_SIZE);
+	f->max_size = av_clip(max_size, 1, f->capacity);
 	f->keep_last = !!keep_last;
-	for (i = 0; i < f->max_size; i++)
+	for (i = 0; i < f->capacity; i++)
 		if (!(f->queue[i].frame = av_frame_alloc()))
 			return AVERROR(ENOMEM);
 	return 0;
@@ -739,11 +2470,14 @@ static int frame_queue_init(FrameQueue *f, PacketQueue *pktq, int max_size, int
 static void frame_queue_destory(FrameQueue *f)
 {
 	int i;
-	for (i = 0; i < f->max_size; i++) {
+	for (i = 0; f->queue && i < f->capacity; i++) {
 		Frame *vp = &f->queue[i];
 		frame_queue_unref_item(vp);
 		av_frame_free(&vp->frame);
 	}
+	av_freep(&f->queue);
+	mem_account(f->mem, MEM_FRAMES, -f->mem_bytes);
+	f->mem_bytes = 0;
 	SDL_DestroyMutex(f->mutex);
 	SDL_DestroyCond(f->cond);
 }
@@ -757,12 +2491,12 @@ static void frame_queue_signal(FrameQueue *f)
 
 static Frame *frame_queue_peek(FrameQueue *f)
 {
-	return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+	return &f->queue[(f->rindex + f->rindex_shown) % f->capacity];
 }
 
 static Frame *frame_queue_peek_next(FrameQueue *f)
 {
-	return &f->queue[(f->rindex + f->rindex_shown + 1) % f->max_size];
+	return &f->queue[(f->rindex + f->rindex_shown + 1) % f->capacity];
 }
 
 static Frame *frame_queue_peek_last(FrameQueue *f)
@@ -799,34 +2533,76 @@ static Frame *frame_queue_peek_readable(FrameQueue *f)
 	if (f->pktq->abort_request)
 		return NULL;
 
-	return &f->queue[(f->rindex + f->rindex_shown) % f->max_size];
+	return &f->queue[(f->rindex + f->rindex_shown) % f->capacity];
+}
+
+static int frame_mem_size(Frame *vp)
+{
+	AVFrame *frame = vp->frame;
+	int i, size = 0;
+
+	for (i = 0; i < FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+		size += frame->buf[i]->size;
+	for (i = 0; i < frame->nb_extended_buf; i++)
+		size += frame->extended_buf[i]->size;
+	for (i = 0; i < vp->sub.num_rects; i++) {
+		size += vp->sub.rects[i]->linesize[0] * vp->sub.rects[i]->h;
+		if (vp->sub_bitmaps)
+			size += vp->sub_bitmaps[i].size;
+	}
+	return size;
 }
 
 static void frame_queue_push(FrameQueue *f)
 {
-	if (++f->windex == f->max_size)
+	Frame *vp = &f->queue[f->windex];
+	vp->mem_size = frame_mem_size(vp);
+	if (++f->windex == f->capacity)
 		f->windex = 0;
 	SDL_LockMutex(f->mutex);
 	f->size++;
+	f->mem_bytes += vp->mem_size;
+	mem_account(f->mem, MEM_FRAMES, vp->mem_size);
 	SDL_CondSignal(f->cond);
 	SDL_UnlockMutex(f->mutex);
 }
 
 static void frame_queue_next(FrameQueue *f)
 {
+	int mem_size;
 	if (f->keep_last && !f->rindex_shown) {
 		f->rindex_shown = 1;
 		return;
 	}
+	mem_size = f->queue[f->rindex].mem_size;
 	frame_queue_unref_item(&f->queue[f->rindex]);
-	if (++f->rindex == f->max_size)
+	if (++f->rindex == f->capacity)
 		f->rindex = 0;
 	SDL_LockMutex(f->mutex);
 	f->size--;
+	f->mem_bytes -= mem_size;
+	mem_account(f->mem, MEM_FRAMES, -mem_size);
+	SDL_CondSignal(f->cond);
+	SDL_UnlockMutex(f->mutex);
+}
+
+static void frame_queue_set_max_size(FrameQueue *f, int max_size)
+{
+	SDL_LockMutex(f->mutex);
+	f->max_size = av_clip(max_size, 1, f->capacity);
 	SDL_CondSignal(f->cond);
 	SDL_UnlockMutex(f->mutex);
 }
 
+static int64_t frame_queue_mem_bytes(FrameQueue *f)
+{
+	int64_t mem_bytes;
+	SDL_LockMutex(f->mutex);
+	mem_bytes = f->mem_bytes;
+	SDL_UnlockMutex(f->mutex);
+	return mem_bytes;
+}
+
 /* return the number of undisplayed frames in the queue */
 static int frame_queue_nb_remaining(FrameQueue *f)
 {
@@ -847,9 +2623,15 @@ static void decoder_abort(Decoder *d, FrameQueue *fq)
 {
 	packet_queue_abort(d->queue);
 	frame_queue_signal(fq);
+	/* a step waiting for the decode scheduler sees the abort */
+	if (decode_scheduler.mutex) {
+		SDL_LockMutex(decode_scheduler.mutex);
+		SDL_CondBroadcast(decode_scheduler.cond);
+		SDL_UnlockMutex(decode_scheduler.mutex);
+	}
 	SDL_WaitThread(d->decoder_tid, NULL);
 	d->decoder_tid = NULL;
-	packet_queue_flush(d->queue);
+	packet_queue_release(d->queue);
 }
 
 static inline void fill_rectangle(int x, int y, int w, int h)
@@ -863,17 +2645,37 @@ static inline void fill_rectangle(int x, int y, int w, int h)
 		SDL_RenderFillRect(renderer, &rect);
 }
 
-static int realloc_texture(SDL_Texture **texture, Uint32 new_format, int new_width, int new_height, SDL_BlendMode blendmode, int init_texture)
+static int64_t texture_mem_size(Uint32 format, int w, int h)
+{
+	if (format == SDL_PIXELFORMAT_IYUV || format == SDL_PIXELFORMAT_YV12 ||
+		format == SDL_PIXELFORMAT_NV12 || format == SDL_PIXELFORMAT_NV21)
+		return (int64_t)w * h * 3 / 2;
+	return (int64_t)w * h * SDL_BYTESPERPIXEL(format);
+}
+
+static void destroy_texture(MemoryBudget *mem, SDL_Texture **texture)
+{
+	Uint32 format;
+	int access, w, h;
+	if (!*texture)
+		return;
+	if (SDL_QueryTexture(*texture, &format, &access, &w, &h) == 0)
+		mem_account(mem, MEM_TEXTURES, -texture_mem_size(format, w, h));
+	SDL_DestroyTexture(*texture);
+	*texture = NULL;
+}
+
+static int realloc_texture(MemoryBudget *mem, SDL_Texture **texture, Uint32 new_format, int new_width, int new_height, SDL_BlendMode blendmode, int init_texture)
 {
 	Uint32 format;
 	int access, w, h;
 	if (!*texture || SDL_QueryTexture(*texture, &format, &access, &w, &h) < 0 || new_width != w || new_height != h || new_format != format) {
 		void *pixels;
 		int pitch;
-		if (*texture)
-			SDL_DestroyTexture(*texture);
+		destroy_texture(mem, texture);
 		if (!(*texture = SDL_CreateTexture(renderer, new_format, SDL_TEXTUREACCESS_STREAMING, new_width, new_height)))
 			return -1;
+		mem_account(mem, MEM_TEXTURES, texture_mem_size(new_format, new_width, new_height));
 		if (SDL_SetTextureBlendMode(*texture, blendmode) < 0)
 			return -1;
 		if (init_texture) {
@@ -953,16 +2755,254 @@ static void get_sdl_pix_fmt_and_blendmode(int format, Uint32 *sdl_pix_fmt, SDL_B
 	}
 }
 
-static int upload_texture(SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx) {
+/*
+ * Worker threads for the conversions of the display thread, which run one
+ * job at a time as horizontal slices, the calling thread taking slices too.
+ * Started on first use and kept for the life of the process.
+ */
+typedef struct ConvertPool {
+	SDL_SpinLock init_lock;
+	SDL_mutex *mutex;
+	SDL_cond *cond;             /* slices posted or finished */
+	int nb_threads;
+	void(*func)(void *arg, int slice, int nb_slices);
+	void *arg;
+	int nb_slices;
+	int next_slice;
+	int nb_done;
+} ConvertPool;
+
+static ConvertPool convert_pool;
+
+static void convert_pool_run_slices(ConvertPool *cp)
+{
+	int slice;
+
+	while (cp->next_slice < cp->nb_slices) {
+		slice = cp->next_slice++;
+		SDL_UnlockMutex(cp->mutex);
+		cp->func(cp->arg, slice, cp->nb_slices);
+		SDL_LockMutex(cp->mutex);
+		if (++cp->nb_done == cp->nb_slices)
+			SDL_CondBroadcast(cp->cond);
+	}
+}
+
+static int convert_pool_thread(void *arg)
+{
+	ConvertPool *cp = arg;
+
+	SDL_LockMutex(cp->mutex);
+	for (;;) {
+		while (cp->next_slice >= cp->nb_slices)
+			SDL_CondWait(cp->cond, cp->mutex);
+		convert_pool_run_slices(cp);
+	}
+	SDL_UnlockMutex(cp->mutex);
+	return 0;
+}
+
+static void convert_pool_init(ConvertPool *cp)
+{
+	int i;
+
+	SDL_AtomicLock(&cp->init_lock);
+	if (!cp->mutex && (cp->mutex = SDL_CreateMutex()) && (cp->cond = SDL_CreateCond())) {
+		for (i = 0; i < FFMIN(SDL_GetCPUCount(), CONVERT_MAX_SLICES) - 1; i++) {
+			SDL_Thread *tid = SDL_CreateThread(convert_pool_thread, "convert", cp);
+			if (!tid)
+				break;
+			SDL_DetachThread(tid);
+			cp->nb_threads++;
+		}
+	}
+	SDL_AtomicUnlock(&cp->init_lock);
+}
+
+/* slices worth running for rows, one per thread at most */
+static int convert_pool_slices(ConvertPool *cp, int rows)
+{
+	convert_pool_init(cp);
+	if (!cp->cond)
+		return 1;
+	return av_clip(rows / CONVERT_MIN_SLICE_ROWS, 1, cp->nb_threads + 1);
+}
+
+static void convert_pool_execute(ConvertPool *cp, void(*func)(void *arg, int slice, int nb_slices), void *arg, int nb_slices)
+{
+	if (nb_slices <= 1 || !cp->cond) {
+		func(arg, 0, 1);
+		return;
+	}
+	SDL_LockMutex(cp->mutex);
+	cp->func = func;
+	cp->arg = arg;
+	cp->nb_done = 0;
+	cp->next_slice = 0;
+	cp->nb_slices = nb_slices;
+	SDL_CondBroadcast(cp->cond);
+	convert_pool_run_slices(cp);
+	while (cp->nb_done < cp->nb_slices)
+		SDL_CondWait(cp->cond, cp->mutex);
+	SDL_UnlockMutex(cp->mutex);
+}
+
+#if HAVE_AVX2_INTRINSICS
+static void narrow_row_avx2(uint8_t *dst, const uint16_t *src, int samples, int shift)
+{
+	__m128i sh = _mm_cvtsi32_si128(shift);
+	int x;
+
+	for (x = 0; x + 32 <= samples; x += 32) {
+		__m256i a = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(src + x)), sh);
+		__m256i b = _mm256_srl_epi16(_mm256_loadu_si256((const __m256i *)(src + x + 16)), sh);
+		/* packus works within 128 bit lanes, put the quadwords back in order */
+		_mm256_storeu_si256((__m256i *)(dst + x), _mm256_permute4x64_epi64(_mm256_packus_epi16(a, b), 0xD8));
+	}
+	for (; x < samples; x++)
+		dst[x] = src[x] >> shift;
+}
+#endif
+
+/* keep the high 8 bits of 16 bit samples stored shift bits above them */
+static void narrow_row(uint8_t *dst, const uint16_t *src, int samples, int shift)
+{
+	int x = 0;
+
+#if HAVE_SSE2_INTRINSICS
+	__m128i sh = _mm_cvtsi32_si128(shift);
+
+	for (; x + 16 <= samples; x += 16) {
+		__m128i a = _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(src + x)), sh);
+		__m128i b = _mm_srl_epi16(_mm_loadu_si128((const __m128i *)(src + x + 8)), sh);
+		_mm_storeu_si128((__m128i *)(dst + x), _mm_packus_epi16(a, b));
+	}
+#endif
+	for (; x < samples; x++)
+		dst[x] = src[x] >> shift;
+}
+
+enum {
+	PLANE_COPY,
+	PLANE_NARROW,               /* 16 bit samples to 8 */
+};
+
+typedef struct PlaneConversion {
+	int type;
+	uint8_t *dst;
+	int dst_linesize;
+	const uint8_t *src;
+	int src_linesize;
+	int w, h;                   /* samples per row and rows */
+	int shift;
+} PlaneConversion;
+
+typedef struct PlanesJob {
+	PlaneConversion planes[4];
+	int nb_planes;
+	int avx2;
+} PlanesJob;
+
+static void convert_planes_slice(void *arg, int slice, int nb_slices)
+{
+	PlanesJob *job = arg;
+	int i, y;
+
+	for (i = 0; i < job->nb_planes; i++) {
+		PlaneConversion *p = &job->planes[i];
+		int y0 = p->h * slice / nb_slices, y1 = p->h * (slice + 1) / nb_slices;
+		uint8_t *dst = p->dst + y0 * p->dst_linesize;
+
+		switch (p->type) {
+		case PLANE_COPY:
+			av_image_copy_plane(dst, p->dst_linesize, p->src + y0 * p->src_linesize, p->src_linesize, p->w, y1 - y0);
+			break;
+		case PLANE_NARROW:
+			for (y = y0; y < y1; y++, dst += p->dst_linesize) {
+				const uint16_t *src = (const uint16_t *)(p->src + y * p->src_linesize);
+#if HAVE_AVX2_INTRINSICS
+				if (job->avx2) {
+					narrow_row_avx2(dst, src, p->w, p->shift);
+					continue;
+				}
+#endif
+				narrow_row(dst, src, p->w, p->shift);
+			}
+			break;
+		}
+	}
+}
+
+/*
+ * Set up the copy of the planes of a 4:2:0 planar or semi-planar frame into a
+ * picture laid out plane after plane from pixels, like a locked texture,
+ * narrowing high bit depth samples.
+ */
+static void planes_job_init(PlanesJob *job, AVFrame *frame, uint8_t *pixels, int pitch)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int i;
+
+	memset(job, 0, sizeof(*job));
+	job->nb_planes = av_pix_fmt_count_planes(frame->format);
+	job->avx2 = !!(av_get_cpu_flags() & AV_CPU_FLAG_AVX2);
+	for (i = 0; i < job->nb_planes; i++) {
+		PlaneConversion *p = &job->planes[i];
+		int semi = job->nb_planes == 2 && i;
+
+		p->w = i ? AV_CEIL_RSHIFT(frame->width, 1) : frame->width;
+		p->h = i ? AV_CEIL_RSHIFT(frame->height, 1) : frame->height;
+		if (semi)
+			p->w *= 2;
+		p->dst = pixels;
+		p->dst_linesize = !i ? pitch : semi ? (pitch + 1) / 2 * 2 : (pitch + 1) / 2;
+		p->src = frame->data[i];
+		p->src_linesize = frame->linesize[i];
+		/* in memory order, the renderer flips the picture */
+		if (p->src_linesize < 0) {
+			p->src += p->src_linesize * (p->h - 1);
+			p->src_linesize = -p->src_linesize;
+		}
+		if (desc->comp[0].depth > 8) {
+			p->type = PLANE_NARROW;
+			p->shift = desc->comp[0].shift + desc->comp[0].depth - 8;
+		}
+		else
+			p->type = PLANE_COPY;
+		pixels += p->dst_linesize * p->h;
+	}
+}
+
+/*
+ * Copy a frame into a locked 4:2:0 texture, which SDL lays out plane after
+ * plane, in slices on the convert pool. SDL 2.0.9 has no update call taking
+ * separate NV12 planes.
+ */
+static int upload_texture_planes(SDL_Texture *tex, AVFrame *frame)
+{
+	PlanesJob job;
+	uint8_t *pixels;
+	int pitch;
+
+	if (SDL_LockTexture(tex, NULL, (void **)&pixels, &pitch) < 0)
+		return -1;
+	planes_job_init(&job, frame, pixels, pitch);
+	convert_pool_execute(&convert_pool, convert_planes_slice, &job, convert_pool_slices(&convert_pool, frame->height));
+	SDL_UnlockTexture(tex);
+	return 0;
+}
+
+static int upload_texture(MemoryBudget *mem, SDL_Texture **tex, AVFrame *frame, struct SwsContext **img_convert_ctx) {
 	int ret = 0;
 	Uint32 sdl_pix_fmt;
 	SDL_BlendMode sdl_blendmode;
 	get_sdl_pix_fmt_and_blendmode(frame->format, &sdl_pix_fmt, &sdl_blendmode);
-	if (realloc_texture(tex, sdl_pix_fmt == SDL_PIXELFORMAT_UNKNOWN ? SDL_PIXELFORMAT_ARGB8888 : sdl_pix_fmt, frame->width, frame->height, sdl_blendmode, 0) < 0)
+	if (realloc_texture(mem, tex, sdl_pix_fmt == SDL_PIXELFORMAT_UNKNOWN ? SDL_PIXELFORMAT_ARGB8888 : sdl_pix_fmt, frame->width, frame->height, sdl_blendmode, 0) < 0)
 		return -1;
 	switch (sdl_pix_fmt) {
 	case SDL_PIXELFORMAT_UNKNOWN:
 		/* This should only happen if we are not using avfilter... */
+		/* in one piece: a context per slice would filter chroma up to the slice edges and leave seams */
 		*img_convert_ctx = sws_getCachedContext(*img_convert_ctx,
 			frame->width, frame->height, frame->format, frame->width, frame->height,
 			AV_PIX_FMT_BGRA, sws_flags, NULL, NULL, NULL);
@@ -981,7 +3021,9 @@ static int upload_texture(SDL_Texture **tex, AVFrame *frame, struct SwsContext *
 		}
 		break;
 	case SDL_PIXELFORMAT_IYUV:
-		if (frame->linesize[0] > 0 && frame->linesize[1] > 0 && frame->linesize[2] > 0) {
+		if (frame->format != AV_PIX_FMT_YUV420P)
+			ret = upload_texture_planes(*tex, frame);
+		else if (frame->linesize[0] > 0 && frame->linesize[1] > 0 && frame->linesize[2] > 0) {
 			ret = SDL_UpdateYUVTexture(*tex, NULL, frame->data[0], frame->linesize[0],
 				frame->data[1], frame->linesize[1],
 				frame->data[2], frame->linesize[2]);
@@ -996,6 +3038,10 @@ static int upload_texture(SDL_Texture **tex, AVFrame *frame, struct SwsContext *
 			return -1;
 		}
 		break;
+	case SDL_PIXELFORMAT_NV12:
+	case SDL_PIXELFORMAT_NV21:
+		ret = upload_texture_planes(*tex, frame);
+		break;
 	default:
 		if (frame->linesize[0] < 0) {
 			ret = SDL_UpdateTexture(*tex, NULL, frame->data[0] + frame->linesize[0] * (frame->height - 1), -frame->linesize[0]);
@@ -1012,7 +3058,9 @@ static void set_sdl_yuv_conversion_mode(AVFrame *frame)
 {
 #if SDL_VERSION_ATLEAST(2,0,8)
 	SDL_YUV_CONVERSION_MODE mode = SDL_YUV_CONVERSION_AUTOMATIC;
-	if (frame && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUYV422 || frame->format == AV_PIX_FMT_UYVY422)) {
+	if (frame && (frame->format == AV_PIX_FMT_YUV420P || frame->format == AV_PIX_FMT_YUYV422 || frame->format == AV_PIX_FMT_UYVY422 ||
+		frame->format == AV_PIX_FMT_NV12 || frame->format == AV_PIX_FMT_NV21 ||
+		frame->format == AV_PIX_FMT_YUV420P10 || frame->format == AV_PIX_FMT_P010)) {
 		if (frame->color_range == AVCOL_RANGE_JPEG)
 			mode = SDL_YUV_CONVERSION_JPEG;
 		else if (frame->colorspace == AVCOL_SPC_BT709)
@@ -1024,6 +3072,41 @@ static void set_sdl_yuv_conversion_mode(AVFrame *frame)
 #endif
 }
 
+static int upload_picture(VideoState *is, SDL_Texture **tex, Frame *vp)
+{
+	int64_t start = av_gettime_relative(), elapsed;
+	UploadStats *us;
+
+	if (upload_texture(&is->mem, tex, vp->frame, &is->img_convert_ctx) < 0)
+		return -1;
+	elapsed = av_gettime_relative() - start;
+	if (vp->frame->format >= 0 && vp->frame->format < AV_PIX_FMT_NB) {
+		us = &is->upload_stats[vp->frame->format];
+		us->count++;
+		us->total += elapsed;
+		us->max = FFMAX(us->max, elapsed);
+	}
+	is->upload_time += elapsed;
+	is->nb_uploads++;
+	vp->flip_v = vp->frame->linesize[0] < 0;
+	return 0;
+}
+
+/* upload the next picture into the spare texture while it waits for its display time */
+static void preload_picture(VideoState *is, Frame *vp)
+{
+	if (vp->uploaded || vp->preloaded || !renderer || display_disable || stop_show > 0 || is_stoped > 0 ||
+		is->show_mode != SHOW_MODE_VIDEO)
+		return;
+	if (is->preload_frame)
+		is->preload_frame->preloaded = 0;
+	is->preload_frame = NULL;
+	if (upload_picture(is, &is->next_texture, vp) < 0)
+		return;
+	vp->preloaded = 1;
+	is->preload_frame = vp;
+}
+
 static void video_image_display(VideoState *is)
 {
 	Frame *vp;
@@ -1031,20 +3114,23 @@ static void video_image_display(VideoState *is)
 	SDL_Rect rect;
 
 	vp = frame_queue_peek_last(&is->pictq);
+	if (is->seek_request_time && vp->serial == is->seek_display_serial) {
+		is->seek_latency = (av_gettime_relative() - is->seek_request_time) / 1000000.0;
+		is->seek_request_time = 0;
+		av_log(NULL, AV_LOG_DEBUG, "seek to first picture took %0.3f s\n", is->seek_latency);
+	}
 	if (is->subtitle_st) {
 		if (frame_queue_nb_remaining(&is->subpq) > 0) {
 			sp = frame_queue_peek(&is->subpq);
 
 			if (vp->pts >= sp->pts + ((float)sp->sub.start_display_time / 1000)) {
 				if (!sp->uploaded) {
-					uint8_t* pixels[4];
-					int pitch[4];
 					int i;
 					if (!sp->width || !sp->height) {
 						sp->width = vp->width;
 						sp->height = vp->height;
 					}
-					if (realloc_texture(&is->sub_texture, SDL_PIXELFORMAT_ARGB8888, sp->width, sp->height, SDL_BLENDMODE_BLEND, 1) < 0)
+					if (realloc_texture(&is->mem, &is->sub_texture, SDL_PIXELFORMAT_ARGB8888, sp->width, sp->height, SDL_BLENDMODE_BLEND, 1) < 0)
 						return;
 
 					for (i = 0; i < sp->sub.num_rects; i++) {
@@ -1055,19 +3141,8 @@ static void video_image_display(VideoState *is)
 						sub_rect->w = av_clip(sub_rect->w, 0, sp->width - sub_rect->x);
 						sub_rect->h = av_clip(sub_rect->h, 0, sp->height - sub_rect->y);
 
-						is->sub_convert_ctx = sws_getCachedContext(is->sub_convert_ctx,
-							sub_rect->w, sub_rect->h, AV_PIX_FMT_PAL8,
-							sub_rect->w, sub_rect->h, AV_PIX_FMT_BGRA,
-							0, NULL, NULL, NULL);
-						if (!is->sub_convert_ctx) {
-							av_log(NULL, AV_LOG_FATAL, "Cannot initialize the conversion context\n");
-							return;
-						}
-						if (!SDL_LockTexture(is->sub_texture, (SDL_Rect *)sub_rect, (void **)pixels, pitch)) {
-							sws_scale(is->sub_convert_ctx, (const uint8_t * const *)sub_rect->data, sub_rect->linesize,
-								0, sub_rect->h, pixels, pitch);
-							SDL_UnlockTexture(is->sub_texture);
-						}
+						if (sp->sub_bitmaps[i].pixels && sub_rect->w && sub_rect->h)
+							SDL_UpdateTexture(is->sub_texture, (SDL_Rect *)sub_rect, sp->sub_bitmaps[i].pixels, sp->sub_bitmaps[i].pitch);
 					}
 					sp->uploaded = 1;
 				}
@@ -1080,10 +3155,16 @@ static void video_image_display(VideoState *is)
 	calculate_display_rect(&rect, is->xleft, is->ytop, is->width, is->height, vp->width, vp->height, vp->sar);
 
 	if (!vp->uploaded) {
-		if (upload_texture(&is->vid_texture, vp->frame, &is->img_convert_ctx) < 0)
+		if (vp->preloaded) {
+			/* presenting only swaps in the texture uploaded ahead */
+			FFSWAP(SDL_Texture *, is->vid_texture, is->next_texture);
+			vp->preloaded = 0;
+			is->preload_frame = NULL;
+			is->nb_preloaded++;
+		}
+		else if (upload_picture(is, &is->vid_texture, vp) < 0)
 			return;
 		vp->uploaded = 1;
-		vp->flip_v = vp->frame->linesize[0] < 0;
 	}
 
 	set_sdl_yuv_conversion_mode(vp->frame);
@@ -1113,6 +3194,11 @@ static inline int compute_mod(int a, int b)
 	return a < 0 ? a%b + b : a%b;
 }
 
+static int64_t rdft_data_size(int rdft_bits)
+{
+	return (int64_t)(1 << (rdft_bits - 1)) * 4 * sizeof(FFTSample);
+}
+
 static void video_audio_display(VideoState *s)
 {
 	int i, i_start, x, y1, y, ys, delay, n, nb_display_channels;
@@ -1201,16 +3287,20 @@ static void video_audio_display(VideoState *s)
 		}
 	}
 	else {
-		if (realloc_texture(&s->vis_texture, SDL_PIXELFORMAT_ARGB8888, s->width, s->height, SDL_BLENDMODE_NONE, 1) < 0)
+		if (realloc_texture(&s->mem, &s->vis_texture, SDL_PIXELFORMAT_ARGB8888, s->width, s->height, SDL_BLENDMODE_NONE, 1) < 0)
 			return;
 
 		nb_display_channels = FFMIN(nb_display_channels, 2);
 		if (rdft_bits != s->rdft_bits) {
 			av_rdft_end(s->rdft);
+			if (s->rdft_data)
+				mem_account(&s->mem, MEM_VISUALIZER, -rdft_data_size(s->rdft_bits));
 			av_free(s->rdft_data);
 			s->rdft = av_rdft_init(rdft_bits, DFT_R2C);
 			s->rdft_bits = rdft_bits;
 			s->rdft_data = av_malloc_array(nb_freq, 4 * sizeof(*s->rdft_data));
+			if (s->rdft_data)
+				mem_account(&s->mem, MEM_VISUALIZER, rdft_data_size(rdft_bits));
 		}
 		if (!s->rdft || !s->rdft_data) {
 			av_log(NULL, AV_LOG_ERROR, "Failed to allocate buffers for RDFT, switching to waves display\n");
@@ -1259,14 +3349,44 @@ static void video_audio_display(VideoState *s)
 	}
 }
 
-static void stream_component_close(VideoState *is, int stream_index)
+/* stream of the main input, or of the external input for EXTERNAL_STREAM_BASE + n */
+static AVStream *stream_lookup(VideoState *is, int stream_index, AVFormatContext **pic)
 {
 	AVFormatContext *ic = is->ic;
+
+	if (stream_index >= EXTERNAL_STREAM_BASE) {
+		ExternalInput *ext;
+		if (stream_index - EXTERNAL_STREAM_BASE >= EXTERNAL_INPUT_NB)
+			return NULL;
+		ext = &is->ext[stream_index - EXTERNAL_STREAM_BASE];
+		ic = ext->ic;
+		stream_index = ext->st ? ext->st->index : -1;
+	}
+	if (!ic || stream_index < 0 || stream_index >= ic->nb_streams)
+		return NULL;
+	*pic = ic;
+	return ic->streams[stream_index];
+}
+
+/* the stream id when read_thread feeds the stream, -1 when nothing or an external input does */
+static int stream_in_main(int stream_id)
+{
+	return stream_id < EXTERNAL_STREAM_BASE ? stream_id : -1;
+}
+
+static void stream_component_close(VideoState *is, int stream_index)
+{
+	AVFormatContext *ic;
+	AVStream *st = stream_lookup(is, stream_index, &ic);
+	ExternalInput *ext = stream_index >= EXTERNAL_STREAM_BASE ? &is->ext[stream_index - EXTERNAL_STREAM_BASE] : NULL;
 	AVCodecParameters *codecpar;
 
-	if (stream_index < 0 || stream_index >= ic->nb_streams)
+	if (!st)
 		return;
-	codecpar = ic->streams[stream_index]->codecpar;
+	codecpar = st->codecpar;
+	/* keep the external reader off the queue while the stream goes away */
+	if (ext)
+		SDL_LockMutex(ext->mutex);
 
 	switch (codecpar->codec_type) {
 	case AVMEDIA_TYPE_AUDIO:
@@ -1280,12 +3400,19 @@ static void stream_component_close(VideoState *is, int stream_index)
 
 		if (is->rdft) {
 			av_rdft_end(is->rdft);
+			if (is->rdft_data)
+				mem_account(&is->mem, MEM_VISUALIZER, -rdft_data_size(is->rdft_bits));
 			av_freep(&is->rdft_data);
 			is->rdft = NULL;
 			is->rdft_bits = 0;
 		}
 		break;
 	case AVMEDIA_TYPE_VIDEO:
+		/* abort first, so a video_thread waiting for the reverse player sees it */
+		packet_queue_abort(&is->videoq);
+		SDL_LockMutex(is->rev.mutex);
+		SDL_CondBroadcast(is->rev.cond);
+		SDL_UnlockMutex(is->rev.mutex);
 		decoder_abort(&is->viddec, &is->pictq);
 		decoder_destroy(&is->viddec);
 		break;
@@ -1297,7 +3424,7 @@ static void stream_component_close(VideoState *is, int stream_index)
 		break;
 	}
 
-	ic->streams[stream_index]->discard = AVDISCARD_ALL;
+	st->discard = AVDISCARD_ALL;
 	switch (codecpar->codec_type) {
 	case AVMEDIA_TYPE_AUDIO:
 		is->audio_st = NULL;
@@ -1314,10 +3441,305 @@ static void stream_component_close(VideoState *is, int stream_index)
 	default:
 		break;
 	}
+	if (ext)
+		SDL_UnlockMutex(ext->mutex);
+}
+
+static uint64_t hash_path(const char *path)
+{
+	uint64_t hash = UINT64_C(0xcbf29ce484222325);
+	for (; *path; path++)
+		hash = (hash ^ (uint8_t)*path) * UINT64_C(0x100000001b3);
+	return hash;
+}
+
+static int file_size_and_mtime(const char *url, int64_t *size, int64_t *mtime)
+{
+	const char *path = url;
+
+	av_strstart(url, "file:", &path);
+	if (strstr(path, "://"))
+		return -1;
+#ifdef _WIN32
+	{
+		struct _stat64 st;
+		wchar_t wpath[MAX_PATH];
+		if (!MultiByteToWideChar(CP_UTF8, 0, path, -1, wpath, MAX_PATH) || _wstat64(wpath, &st) < 0)
+			return -1;
+		*size = st.st_size;
+		*mtime = st.st_mtime;
+	}
+#else
+	{
+		struct stat st;
+		if (stat(path, &st) < 0)
+			return -1;
+		*size = st.st_size;
+		*mtime = st.st_mtime;
+	}
+#endif
+	return 0;
+}
+
+/* insert a keyframe, keeping the entries sorted and unique; call with the mutex held */
+static int keyframe_index_add(KeyframeIndex *idx, int64_t pts, int64_t pos)
+{
+	KeyframeEntry *entries;
+	int lo = 0, hi = idx->nb_entries;
+
+	if (hi && idx->entries[hi - 1].pts < pts) {
+		lo = hi;
+	}
+	else {
+		while (lo < hi) {
+			int mid = (lo + hi) / 2;
+			if (idx->entries[mid].pts < pts)
+				lo = mid + 1;
+			else
+				hi = mid;
+		}
+		if (lo < idx->nb_entries && idx->entries[lo].pts == pts)
+			return 0;
+	}
+
+	entries = av_fast_realloc(idx->entries, &idx->entries_size, (idx->nb_entries + 1) * sizeof(*entries));
+	if (!entries)
+		return AVERROR(ENOMEM);
+	idx->entries = entries;
+	memmove(&entries[lo + 1], &entries[lo], (idx->nb_entries - lo) * sizeof(*entries));
+	entries[lo].pts = pts;
+	entries[lo].pos = pos;
+	idx->nb_entries++;
+	idx->dirty = 1;
+	return 0;
+}
+
+/*
+ * Byte position of the last keyframe at or before target (AV_TIME_BASE).
+ * An index built while playing may have holes, so unless it is complete it
+ * must also know a keyframe after the target.
+ */
+static int keyframe_index_lookup(KeyframeIndex *idx, int64_t target, int64_t *pos)
+{
+	int lo = 0, hi, found = 0;
+
+	if (idx->stream_index < 0)
+		return 0;
+	target = av_rescale_q(target, AV_TIME_BASE_Q, idx->time_base);
+	SDL_LockMutex(idx->mutex);
+	hi = idx->nb_entries;
+	while (lo < hi) {
+		int mid = (lo + hi) / 2;
+		if (idx->entries[mid].pts <= target)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	if (lo > 0 && (idx->complete || lo < idx->nb_entries)) {
+		*pos = idx->entries[lo - 1].pos;
+		found = 1;
+	}
+	SDL_UnlockMutex(idx->mutex);
+	return found;
+}
+
+static void keyframe_index_load(KeyframeIndex *idx)
+{
+	KeyframeIndexHeader hdr;
+	FILE *f = fopen(idx->cache_path, "rb");
+
+	if (!f)
+		return;
+	if (fread(&hdr, sizeof(hdr), 1, f) == 1 &&
+		hdr.magic == KEYFRAME_INDEX_MAGIC &&
+		hdr.path_hash == idx->path_hash &&
+		hdr.file_size == idx->file_size &&
+		hdr.file_mtime == idx->file_mtime &&
+		hdr.stream_index == idx->stream_index &&
+		hdr.codec_id == idx->codec_id &&
+		hdr.tb_num == idx->time_base.num &&
+		hdr.tb_den == idx->time_base.den &&
+		hdr.nb_entries > 0 && hdr.nb_entries < INT_MAX / sizeof(KeyframeEntry) &&
+		(idx->entries = av_malloc_array(hdr.nb_entries, sizeof(KeyframeEntry)))) {
+		idx->entries_size = hdr.nb_entries * sizeof(KeyframeEntry);
+		if (fread(idx->entries, sizeof(KeyframeEntry), hdr.nb_entries, f) == hdr.nb_entries) {
+			idx->nb_entries = hdr.nb_entries;
+			idx->complete = hdr.complete;
+			av_log(NULL, AV_LOG_VERBOSE, "loaded %d keyframes from %s\n", idx->nb_entries, idx->cache_path);
+		}
+	}
+	fclose(f);
+}
+
+/* write to a temporary file first, so a crash never leaves a truncated index behind */
+static void keyframe_index_save(KeyframeIndex *idx)
+{
+	KeyframeIndexHeader hdr = { 0 };
+	char *tmp_path;
+	FILE *f;
+	int ok;
+
+	SDL_LockMutex(idx->mutex);
+	if (!idx->cache_path || !idx->dirty || !idx->nb_entries ||
+		!(tmp_path = av_asprintf("%s.tmp", idx->cache_path))) {
+		SDL_UnlockMutex(idx->mutex);
+		return;
+	}
+	hdr.magic = KEYFRAME_INDEX_MAGIC;
+	hdr.stream_index = idx->stream_index;
+	hdr.codec_id = idx->codec_id;
+	hdr.tb_num = idx->time_base.num;
+	hdr.tb_den = idx->time_base.den;
+	hdr.complete = idx->complete;
+	hdr.path_hash = idx->path_hash;
+	hdr.file_size = idx->file_size;
+	hdr.file_mtime = idx->file_mtime;
+	hdr.nb_entries = idx->nb_entries;
+	if ((f = fopen(tmp_path, "wb"))) {
+		ok = fwrite(&hdr, sizeof(hdr), 1, f) == 1 &&
+			fwrite(idx->entries, sizeof(*idx->entries), idx->nb_entries, f) == idx->nb_entries;
+		ok = !fclose(f) && ok;
+		remove(idx->cache_path);
+		if (ok && !rename(tmp_path, idx->cache_path))
+			idx->dirty = 0;
+		else
+			remove(tmp_path);
+	}
+	SDL_UnlockMutex(idx->mutex);
+	av_free(tmp_path);
+}
+
+static int keyframe_index_interrupt_cb(void *ctx)
+{
+	KeyframeIndex *idx = ctx;
+	return idx->scan_abort;
+}
+
+/* demux the whole file on a second context and replace the index with the complete result */
+static int keyframe_index_scan_thread(void *arg)
+{
+	KeyframeIndex *idx = arg;
+	KeyframeIndex scan = { 0 };
+	AVFormatContext *ic = avformat_alloc_context();
+	AVPacket pkt;
+	int i, ret;
+
+	if (!ic)
+		return AVERROR(ENOMEM);
+	ic->interrupt_callback.callback = keyframe_index_interrupt_cb;
+	ic->interrupt_callback.opaque = idx;
+	if ((ret = avformat_open_input(&ic, idx->url, NULL, NULL)) < 0)
+		return ret;
+	if ((ret = avformat_find_stream_info(ic, NULL)) < 0 || idx->stream_index >= (int)ic->nb_streams)
+		goto end;
+	for (i = 0; i < ic->nb_streams; i++)
+		if (i != idx->stream_index)
+			ic->streams[i]->discard = AVDISCARD_ALL;
+
+	while (!idx->scan_abort && (ret = av_read_frame(ic, &pkt)) >= 0) {
+		if (pkt.stream_index == idx->stream_index && (pkt.flags & AV_PKT_FLAG_KEY) &&
+			pkt.pts != AV_NOPTS_VALUE && pkt.pos >= 0)
+			ret = keyframe_index_add(&scan, pkt.pts, pkt.pos);
+		av_packet_unref(&pkt);
+		if (ret < 0)
+			break;
+	}
+	if (ret == AVERROR_EOF && !idx->scan_abort && scan.nb_entries) {
+		SDL_LockMutex(idx->mutex);
+		FFSWAP(KeyframeEntry *, idx->entries, scan.entries);
+		FFSWAP(unsigned int, idx->entries_size, scan.entries_size);
+		idx->nb_entries = scan.nb_entries;
+		idx->complete = 1;
+		idx->dirty = 1;
+		SDL_UnlockMutex(idx->mutex);
+		av_log(NULL, AV_LOG_VERBOSE, "indexed %d keyframes of %s\n", idx->nb_entries, idx->url);
+		keyframe_index_save(idx);
+	}
+end:
+	av_free(scan.entries);
+	avformat_close_input(&ic);
+	return 0;
+}
+
+/*
+ * Set up the index for the opened file. Only containers that can seek by
+ * byte and whose own index is missing or unreliable are indexed.
+ */
+static void keyframe_index_open(KeyframeIndex *idx, AVFormatContext *ic, AVStream *st, const char *url)
+{
+	const char *dir = index_cache_dir ? index_cache_dir : getenv("TEMP");
+
+	memset(idx, 0, sizeof(*idx));
+	idx->stream_index = -1;
+	if (!st || (ic->iformat->flags & AVFMT_NO_BYTE_SEEK) ||
+		!((ic->iformat->flags & (AVFMT_TS_DISCONT | AVFMT_GENERIC_INDEX)) || st->nb_index_entries == 0))
+		return;
+	if (!(idx->mutex = SDL_CreateMutex()) || !(idx->url = av_strdup(url)))
+		return;
+	idx->stream_index = st->index;
+	idx->codec_id = st->codecpar->codec_id;
+	idx->time_base = st->time_base;
+	idx->path_hash = hash_path(url);
+
+	if (dir && *dir && file_size_and_mtime(url, &idx->file_size, &idx->file_mtime) == 0 &&
+		(idx->cache_path = av_asprintf("%s/ffplay-%016"PRIx64".kfi", dir, idx->path_hash)))
+		keyframe_index_load(idx);
+}
+
+/* start a background scan of the whole file unless one ran already */
+static int keyframe_index_build(KeyframeIndex *idx)
+{
+	if (idx->stream_index < 0)
+		return -1;
+	if (idx->complete || idx->scan_tid)
+		return 0;
+	if (!(idx->scan_tid = SDL_CreateThread(keyframe_index_scan_thread, "keyframe_index", idx)))
+		return -1;
+	return 0;
+}
+
+static void keyframe_index_close(KeyframeIndex *idx)
+{
+	if (idx->scan_tid) {
+		idx->scan_abort = 1;
+		SDL_WaitThread(idx->scan_tid, NULL);
+		idx->scan_tid = NULL;
+	}
+	if (idx->stream_index >= 0)
+		keyframe_index_save(idx);
+	av_freep(&idx->entries);
+	av_freep(&idx->url);
+	av_freep(&idx->cache_path);
+	SDL_DestroyMutex(idx->mutex);
+	idx->mutex = NULL;
+	idx->stream_index = -1;
+}
+
+static void external_input_close(ExternalInput *ext)
+{
+	int i;
+
+	if (ext->tid) {
+		read_wake_signal(&ext->wake);
+		SDL_WaitThread(ext->tid, NULL);
+		ext->tid = NULL;
+	}
+	for (i = 0; i < ext->nb_packets; i++)
+		av_packet_unref(&ext->packets[i]);
+	av_freep(&ext->packets);
+	ext->nb_packets = 0;
+	avformat_close_input(&ext->ic);
+	mapped_avio_close(&ext->mapped_pb);
+	read_wake_destroy(&ext->wake);
+	SDL_DestroyMutex(ext->mutex);
+	ext->mutex = NULL;
+	ext->st = NULL;
 }
 
 static void stream_close(VideoState *is)
 {
+	int i;
+
 	if (cur_video == NULL)
 		return;
 	/* XXX: use a special url_shutdown call to abort parse cleanly */
@@ -1325,8 +3747,27 @@ static void stream_close(VideoState *is)
 		return;
 
 	is->abort_request = 1;
+	read_wake_signal(&is->continue_read_thread);
+	/* the read-ahead waits for chunks without a timeout, the interrupt callback alone would not wake it */
+	SDL_AtomicLock(&is->read_ahead_lock);
+	if (is->read_ahead)
+		read_ahead_abort(is->read_ahead);
+	SDL_AtomicUnlock(&is->read_ahead_lock);
 	SDL_WaitThread(is->read_tid, NULL);
 
+	for (i = 0; i < AV_PIX_FMT_NB; i++)
+		if (is->upload_stats[i].count)
+			av_log(NULL, AV_LOG_VERBOSE, "texture upload %s: %d pictures, %.3f ms average, %.3f ms max\n",
+				av_get_pix_fmt_name(i), is->upload_stats[i].count,
+				is->upload_stats[i].total / 1000.0 / is->upload_stats[i].count, is->upload_stats[i].max / 1000.0);
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++) {
+		if (is->ext[i].tid) {
+			read_wake_signal(&is->ext[i].wake);
+			SDL_WaitThread(is->ext[i].tid, NULL);
+			is->ext[i].tid = NULL;
+		}
+	}
+
 	/* close each stream */
 	if (is->audio_stream >= 0)
 		stream_component_close(is, is->audio_stream);
@@ -1335,7 +3776,12 @@ static void stream_close(VideoState *is)
 	if (is->subtitle_stream >= 0)
 		stream_component_close(is, is->subtitle_stream);
 
+	keyframe_index_close(&is->kf_index);
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++)
+		external_input_close(&is->ext[i]);
 	avformat_close_input(&is->ic);
+	mapped_avio_close(&is->mapped_pb);
+	read_ahead_close(&is->read_ahead);
 
 	packet_queue_destroy(&is->videoq);
 	packet_queue_destroy(&is->audioq);
@@ -1345,16 +3791,15 @@ static void stream_close(VideoState *is)
 	frame_queue_destory(&is->pictq);
 	frame_queue_destory(&is->sampq);
 	frame_queue_destory(&is->subpq);
-	SDL_DestroyCond(is->continue_read_thread);
+	read_wake_destroy(&is->continue_read_thread);
+	SDL_DestroyCond(is->rev.cond);
+	SDL_DestroyMutex(is->rev.mutex);
 	sws_freeContext(is->img_convert_ctx);
-	sws_freeContext(is->sub_convert_ctx);
 	av_free(is->filename);
-	if (is->vis_texture)
-		SDL_DestroyTexture(is->vis_texture);
-	if (is->vid_texture)
-		SDL_DestroyTexture(is->vid_texture);
-	if (is->sub_texture)
-		SDL_DestroyTexture(is->sub_texture);
+	destroy_texture(&is->mem, &is->vis_texture);
+	destroy_texture(&is->mem, &is->vid_texture);
+	destroy_texture(&is->mem, &is->next_texture);
+	destroy_texture(&is->mem, &is->sub_texture);
 	av_free(is);
 	cur_video = 0;
 }
@@ -1428,9 +3873,12 @@ static int video_open(VideoState *is)
 /* display the current picture, if any */
 static void video_display(VideoState *is)
 {
+	int64_t start, upload_time;
 
 	if (stop_show > 0 || is_stoped > 0)
 		return;
+	start = av_gettime_relative();
+	upload_time = is->upload_time;
 
 	if (!is->width)
 	{
@@ -1447,6 +3895,10 @@ static void video_display(VideoState *is)
 	}
 
 	SDL_RenderPresent(renderer);
+	if (is->video_st && is->show_mode == SHOW_MODE_VIDEO) {
+		is->present_time += av_gettime_relative() - start - (is->upload_time - upload_time);
+		is->nb_presents++;
+	}
 }
 
 static double get_clock(Clock *c)
@@ -1482,6 +3934,14 @@ static void set_clock_speed(Clock *c, double speed)
 	c->speed = speed;
 }
 
+static void set_playback_clock_speed(VideoState *is, double speed)
+{
+	is->speed = speed;
+	set_clock_speed(&is->vidclk, speed);
+	set_clock_speed(&is->audclk, speed);
+	set_clock_speed(&is->extclk, speed);
+}
+
 static void init_clock(Clock *c, int *queue_serial)
 {
 	c->speed = 1.0;
@@ -1499,6 +3959,9 @@ static void sync_clock_to_slave(Clock *c, Clock *slave)
 }
 
 static int get_master_sync_type(VideoState *is) {
+	/* reverse and trick play pictures are paced by their own durations */
+	if ((is->reverse || is->trick_rate) && is->video_st)
+		return AV_SYNC_VIDEO_MASTER;
 	if (is->av_sync_type == AV_SYNC_VIDEO_MASTER) {
 		if (is->video_st)
 			return AV_SYNC_VIDEO_MASTER;
@@ -1554,18 +4017,23 @@ static double get_master_clock(VideoState *is)
 }
 
 static void check_external_clock_speed(VideoState *is) {
-	if (is->video_stream >= 0 && is->videoq.nb_packets <= EXTERNAL_CLOCK_MIN_FRAMES ||
-		is->audio_stream >= 0 && is->audioq.nb_packets <= EXTERNAL_CLOCK_MIN_FRAMES) {
-		set_clock_speed(&is->extclk, FFMAX(EXTERNAL_CLOCK_SPEED_MIN, is->extclk.speed - EXTERNAL_CLOCK_SPEED_STEP));
+	/* adjust relative to the playback speed */
+	double base = is->playback_speed;
+	double speed = is->extclk.speed / base;
+
+	if (is->video_stream >= 0 && packet_queue_nb_packets(&is->videoq) <= EXTERNAL_CLOCK_MIN_FRAMES ||
+		is->audio_stream >= 0 && packet_queue_nb_packets(&is->audioq) <= EXTERNAL_CLOCK_MIN_FRAMES) {
+		set_clock_speed(&is->extclk, base * FFMAX(EXTERNAL_CLOCK_SPEED_MIN, speed - EXTERNAL_CLOCK_SPEED_STEP));
 	}
-	else if ((is->video_stream < 0 || is->videoq.nb_packets > EXTERNAL_CLOCK_MAX_FRAMES) &&
-		(is->audio_stream < 0 || is->audioq.nb_packets > EXTERNAL_CLOCK_MAX_FRAMES)) {
-		set_clock_speed(&is->extclk, FFMIN(EXTERNAL_CLOCK_SPEED_MAX, is->extclk.speed + EXTERNAL_CLOCK_SPEED_STEP));
+	else if ((is->video_stream < 0 || packet_queue_nb_packets(&is->videoq) > EXTERNAL_CLOCK_MAX_FRAMES) &&
+		(is->audio_stream < 0 || packet_queue_nb_packets(&is->audioq) > EXTERNAL_CLOCK_MAX_FRAMES)) {
+		set_clock_speed(&is->extclk, base * FFMIN(EXTERNAL_CLOCK_SPEED_MAX, speed + EXTERNAL_CLOCK_SPEED_STEP));
 	}
 	else {
-		double speed = is->extclk.speed;
-		if (speed != 1.0)
-			set_clock_speed(&is->extclk, speed + EXTERNAL_CLOCK_SPEED_STEP * (1.0 - speed) / fabs(1.0 - speed));
+		if (fabs(speed - 1.0) >= EXTERNAL_CLOCK_SPEED_STEP)
+			set_clock_speed(&is->extclk, base * (speed + EXTERNAL_CLOCK_SPEED_STEP * (1.0 - speed) / fabs(1.0 - speed)));
+		else if (speed != 1.0)
+			set_clock_speed(&is->extclk, base);
 	}
 }
 
@@ -1579,7 +4047,9 @@ static void stream_seek(VideoState *is, int64_t pos, int64_t rel, int seek_by_by
 		if (seek_by_bytes)
 			is->seek_flags |= AVSEEK_FLAG_BYTE;
 		is->seek_req = 1;
-		SDL_CondSignal(is->continue_read_thread);
+		is->seek_request_time = av_gettime_relative();
+		is->seek_display_serial = -1;
+		read_wake_signal(&is->continue_read_thread);
 	}
 }
 
@@ -1595,6 +4065,8 @@ static void stream_toggle_pause(VideoState *is)
 	}
 	set_clock(&is->extclk, get_clock(&is->extclk), is->extclk.serial);
 	is->paused = is->audclk.paused = is->vidclk.paused = is->extclk.paused = !is->paused;
+	/* read_thread pauses and resumes network streams */
+	read_wake_signal(&is->continue_read_thread);
 }
 
 static void toggle_pause(VideoState *is)
@@ -1632,6 +4104,8 @@ static double compute_target_delay(double delay, VideoState *is)
 		/* if video is slave, we try to correct big delays by
 		   duplicating or deleting a frame */
 		diff = get_clock(&is->vidclk) - get_master_clock(is);
+		/* the clocks run in media time, the delay in presentation time */
+		diff /= fabs(is->speed);
 
 		/* skip or repeat frame. We take into account the
 		   delay to compute the threshold. I still don't know
@@ -1655,9 +4129,9 @@ static double compute_target_delay(double delay, VideoState *is)
 
 static double vp_duration(VideoState *is, Frame *vp, Frame *nextvp) {
 	if (vp->serial == nextvp->serial) {
-		double duration = nextvp->pts - vp->pts;
+		double duration = (nextvp->pts - vp->pts) / is->speed;
 		if (isnan(duration) || duration <= 0 || duration > is->max_frame_duration)
-			return vp->duration;
+			return vp->duration / fabs(is->speed);
 		else
 			return duration;
 	}
@@ -1672,6 +4146,78 @@ static void update_video_pts(VideoState *is, double pts, int64_t pos, int serial
 	sync_clock_to_slave(&is->extclk, &is->vidclk);
 }
 
+/*
+ * Clear the rects of a subtitle from its texture. Neighbouring rects share a
+ * lock while their bounds are at most a quarter larger than the rects they
+ * cover; far apart rects, like the top and bottom lines of a 4K subtitle,
+ * are cleared one by one instead of through the frame between them.
+ */
+static void subtitle_clear_rects(SDL_Texture *texture, AVSubtitle *sub)
+{
+	uint8_t *pixels;
+	int pitch, i, j, y;
+
+	for (i = 0; i < sub->num_rects; i = j) {
+		SDL_Rect bounds = *(SDL_Rect *)sub->rects[i];
+		int64_t area = (int64_t)bounds.w * bounds.h;
+
+		for (j = i + 1; j < sub->num_rects; j++) {
+			SDL_Rect *rect = (SDL_Rect *)sub->rects[j];
+			SDL_Rect merged;
+
+			SDL_UnionRect(&bounds, rect, &merged);
+			if ((int64_t)merged.w * merged.h * 4 > (area + (int64_t)rect->w * rect->h) * 5)
+				break;
+			bounds = merged;
+			area += (int64_t)rect->w * rect->h;
+		}
+		if (bounds.w > 0 && bounds.h > 0 && !SDL_LockTexture(texture, &bounds, (void **)&pixels, &pitch)) {
+			for (y = 0; y < bounds.h; y++, pixels += pitch)
+				memset(pixels, 0, bounds.w << 2);
+			SDL_UnlockTexture(texture);
+		}
+	}
+}
+
+static void video_frame_release(VideoFrameRef **pref)
+{
+	VideoFrameRef *ref = *pref;
+
+	if (ref)
+		av_frame_free(&ref->frame);
+	av_freep(pref);
+}
+
+/* pass the picture going on screen to on_video_frame, as a new reference to its buffers */
+static void deliver_video_frame(Frame *vp)
+{
+	void(*func)(FFPlayVideoFrame *, void *);
+	void *user;
+	VideoFrameRef *ref;
+	int i;
+
+	SDL_AtomicLock(&on_video_frame_lock);
+	func = on_video_frame;
+	user = on_video_frame_user;
+	SDL_AtomicUnlock(&on_video_frame_lock);
+	if (!func || !vp->frame->buf[0])
+		return;
+	if (!(ref = av_mallocz(sizeof(*ref))) || !(ref->frame = av_frame_alloc()) ||
+		av_frame_ref(ref->frame, vp->frame) < 0) {
+		video_frame_release(&ref);
+		return;
+	}
+	for (i = 0; i < 4; i++) {
+		ref->pub.data[i] = ref->frame->data[i];
+		ref->pub.linesize[i] = ref->frame->linesize[i];
+	}
+	ref->pub.width = ref->frame->width;
+	ref->pub.height = ref->frame->height;
+	ref->pub.format = ref->frame->format;
+	ref->pub.pts = isnan(vp->pts) ? -1 : (long long)(vp->pts * 1000);
+	func(&ref->pub, user);
+}
+
 /* called to display each frame */
 static void video_refresh(void *opaque, double *remaining_time)
 {
@@ -1724,7 +4270,10 @@ static void video_refresh(void *opaque, double *remaining_time)
 
 			time = av_gettime_relative() / 1000000.0;
 			if (time < is->frame_timer + delay) {
-				*remaining_time = FFMIN(is->frame_timer + delay - time, *remaining_time);
+				/* the upload takes time of its own, wait only for what is left of the delay */
+				preload_picture(is, vp);
+				time = av_gettime_relative() / 1000000.0;
+				*remaining_time = FFMIN(FFMAX(is->frame_timer + delay - time, 0.0), *remaining_time);
 				goto display;
 			}
 
@@ -1760,20 +4309,8 @@ static void video_refresh(void *opaque, double *remaining_time)
 						|| (is->vidclk.pts > (sp->pts + ((float)sp->sub.end_display_time / 1000)))
 						|| (sp2 && is->vidclk.pts > (sp2->pts + ((float)sp2->sub.start_display_time / 1000))))
 					{
-						if (sp->uploaded) {
-							int i;
-							for (i = 0; i < sp->sub.num_rects; i++) {
-								AVSubtitleRect *sub_rect = sp->sub.rects[i];
-								uint8_t *pixels;
-								int pitch, j;
-
-								if (!SDL_LockTexture(is->sub_texture, (SDL_Rect *)sub_rect, (void **)&pixels, &pitch)) {
-									for (j = 0; j < sub_rect->h; j++, pixels += pitch)
-										memset(pixels, 0, sub_rect->w << 2);
-									SDL_UnlockTexture(is->sub_texture);
-								}
-							}
-						}
+						if (sp->uploaded)
+							subtitle_clear_rects(is->sub_texture, &sp->sub);
 						frame_queue_next(&is->subpq);
 					}
 					else {
@@ -1782,6 +4319,7 @@ static void video_refresh(void *opaque, double *remaining_time)
 				}
 			}
 
+			deliver_video_frame(vp);
 			frame_queue_next(&is->pictq);
 			is->force_refresh = 1;
 
@@ -1809,11 +4347,11 @@ static void video_refresh(void *opaque, double *remaining_time)
 			vqsize = 0;
 			sqsize = 0;
 			if (is->audio_st)
-				aqsize = is->audioq.size;
+				aqsize = packet_queue_size(&is->audioq);
 			if (is->video_st)
-				vqsize = is->videoq.size;
+				vqsize = packet_queue_size(&is->videoq);
 			if (is->subtitle_st)
-				sqsize = is->subtitleq.size;
+				sqsize = packet_queue_size(&is->subtitleq);
 			av_diff = 0;
 			if (is->audio_st && is->video_st)
 				av_diff = get_clock(&is->audclk) - get_clock(&is->vidclk);
@@ -1823,7 +4361,7 @@ static void video_refresh(void *opaque, double *remaining_time)
 				av_diff = get_master_clock(is) - get_clock(&is->audclk);
 #ifdef _DEBUG
 			av_log(NULL, AV_LOG_INFO,
-				"%7.2f %s:%7.3f fd=%4d aq=%5dKB vq=%5dKB sq=%5dB f=%"PRId64"/%"PRId64"   \r",
+				"%7.2f %s:%7.3f fd=%4d aq=%5dKB vq=%5dKB sq=%5dB pq=%2d/%5dKB f=%"PRId64"/%"PRId64"   \r",
 				get_master_clock(is),
 				(is->audio_st && is->video_st) ? "A-V" : (is->video_st ? "M-V" : (is->audio_st ? "M-A" : "   ")),
 				av_diff,
@@ -1831,6 +4369,8 @@ static void video_refresh(void *opaque, double *remaining_time)
 				aqsize / 1024,
 				vqsize / 1024,
 				sqsize,
+				is->pictq.max_size,
+				(int)((frame_queue_mem_bytes(&is->pictq) + frame_queue_mem_bytes(&is->sampq)) / 1024),
 				is->video_st ? is->viddec.avctx->pts_correction_num_faulty_dts : 0,
 				is->video_st ? is->viddec.avctx->pts_correction_num_faulty_pts : 0);
 			fflush(stdout);
@@ -1854,6 +4394,7 @@ static int queue_picture(VideoState *is, AVFrame *src_frame, double pts, double
 
 	vp->sar = src_frame->sample_aspect_ratio;
 	vp->uploaded = 0;
+	vp->preloaded = 0;
 
 	vp->width = src_frame->width;
 	vp->height = src_frame->height;
@@ -1886,19 +4427,43 @@ static int get_video_frame(VideoState *is, AVFrame *frame)
 
 		frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(is->ic, is->video_st, frame);
 
+		if (is->viddec.preroll_serial >= 0 || is->viddec.preroll_fast) {
+			AVRational frame_rate = av_guess_frame_rate(is->ic, is->video_st, frame);
+			double duration = frame_rate.num && frame_rate.den ? av_q2d(av_inv_q(frame_rate)) : 0;
+			/* pictures before the target of an accurate seek never reach the filters or the display */
+			if (decoder_preroll_drop(&is->viddec, dpts, dpts + duration)) {
+				av_frame_unref(frame);
+				return 0;
+			}
+		}
+
 		if (framedrop > 0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER)) {
 			if (frame->pts != AV_NOPTS_VALUE) {
 				double diff = dpts - get_master_clock(is);
 				if (!isnan(diff) && fabs(diff) < AV_NOSYNC_THRESHOLD &&
 					diff - is->frame_last_filter_delay < 0 &&
 					is->viddec.pkt_serial == is->vidclk.serial &&
-					is->videoq.nb_packets) {
+					packet_queue_nb_packets(&is->videoq)) {
 					is->frame_drops_early++;
 					av_frame_unref(frame);
 					got_picture = 0;
 				}
 			}
 		}
+
+		/* above normal speed, do not hand the display more pictures than it can show; the decoder skips most of them already */
+		if (got_picture && is->speed > 1.0 && !isnan(dpts)) {
+			if (is->viddec.pkt_serial == is->speed_last_serial && dpts > is->speed_last_pts &&
+				(dpts - is->speed_last_pts) / is->speed < SPEED_MIN_PICTURE_INTERVAL) {
+				is->frame_drops_early++;
+				av_frame_unref(frame);
+				got_picture = 0;
+			}
+			else {
+				is->speed_last_pts = dpts;
+				is->speed_last_serial = is->viddec.pkt_serial;
+			}
+		}
 	}
 
 	return got_picture;
@@ -1964,10 +4529,8 @@ static int configure_video_filters(AVFilterGraph *graph, VideoState *is, const c
 
 	for (i = 0; i < renderer_info.num_texture_formats; i++) {
 		for (j = 0; j < FF_ARRAY_ELEMS(sdl_texture_format_map) - 1; j++) {
-			if (renderer_info.texture_formats[i] == sdl_texture_format_map[j].texture_fmt) {
+			if (renderer_info.texture_formats[i] == sdl_texture_format_map[j].texture_fmt)
 				pix_fmts[nb_pix_fmts++] = sdl_texture_format_map[j].format;
-				break;
-			}
 		}
 	}
 	pix_fmts[nb_pix_fmts] = AV_PIX_FMT_NONE;
@@ -2063,13 +4626,14 @@ static int configure_audio_filters(VideoState *is, const char *afilters, int for
 	int sample_rates[2] = { 0, -1 };
 	int64_t channel_layouts[2] = { 0, -1 };
 	int channels[2] = { 0, -1 };
-	AVFilterContext *filt_asrc = NULL, *filt_asink = NULL;
+	AVFilterContext *filt_asrc = NULL, *filt_asink = NULL, *filt_last;
 	char aresample_swr_opts[512] = "";
 	AVDictionaryEntry *e = NULL;
 	char asrc_args[256];
 	int ret;
 
 	avfilter_graph_free(&is->agraph);
+	is->audio_tempo[0] = is->audio_tempo[1] = NULL;
 	if (!(is->agraph = avfilter_graph_alloc()))
 		return AVERROR(ENOMEM);
 
@@ -2120,18 +4684,55 @@ static int configure_audio_filters(VideoState *is, const char *afilters, int for
 			goto end;
 	}
 
+	filt_last = filt_asink;
+	if (is->audio_tempo_speed != 1.0) {
+		/* each atempo takes 0.5 to 2, two of them cover the whole speed range */
+		char tempo_args[32];
+		int i;
+
+		snprintf(tempo_args, sizeof(tempo_args), "tempo=%f", sqrt(is->audio_tempo_speed));
+		for (i = 1; i >= 0; i--) {
+			AVFilterContext *filt_tempo;
+			char name[32];
+
+			snprintf(name, sizeof(name), "ffplay_atempo%d", i);
+			if ((ret = avfilter_graph_create_filter(&filt_tempo, avfilter_get_by_name("atempo"),
+				name, tempo_args, NULL, is->agraph)) < 0)
+				goto end;
+			if ((ret = avfilter_link(filt_tempo, 0, filt_last, 0)) < 0)
+				goto end;
+			filt_last = filt_tempo;
+			is->audio_tempo[i] = filt_tempo;
+		}
+	}
 
-	if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc, filt_asink)) < 0)
+	if ((ret = configure_filtergraph(is->agraph, afilters, filt_asrc, filt_last)) < 0)
 		goto end;
 
 	is->in_audio_filter = filt_asrc;
 	is->out_audio_filter = filt_asink;
 
 end:
-	if (ret < 0)
+	if (ret < 0) {
 		avfilter_graph_free(&is->agraph);
+		is->audio_tempo[0] = is->audio_tempo[1] = NULL;
+	}
 	return ret;
 }
+
+/* retune the tempo filters in place, the graph and the audio it holds stay */
+static int set_audio_tempo(VideoState *is, double speed)
+{
+	char arg[32];
+	int i, ret;
+
+	snprintf(arg, sizeof(arg), "%f", sqrt(speed));
+	for (i = 0; i < 2; i++)
+		if ((ret = avfilter_process_command(is->audio_tempo[i], "tempo", arg, NULL, 0, 0)) < 0)
+			return ret;
+	is->audio_tempo_speed = speed;
+	return 0;
+}
 #endif  /* CONFIG_AVFILTER */
 
 static int audio_thread(void *arg)
@@ -2143,6 +4744,13 @@ static int audio_thread(void *arg)
 	int last_serial = -1;
 	int64_t dec_channel_layout;
 	int reconfigure;
+	double speed;
+	/*
+	 * atempo stamps its output in presentation time, counting from the first input pts;
+	 * output time since the anchor times the speed is the media time since the anchor
+	 */
+	double anchor_out = NAN, anchor_media = NAN;
+	double out_end = NAN, media_end = NAN;
 #endif
 	int got_frame = 0;
 	AVRational tb;
@@ -2155,6 +4763,14 @@ static int audio_thread(void *arg)
 		if ((got_frame = decoder_decode_frame(&is->auddec, frame, NULL)) < 0)
 			goto the_end;
 
+		if (got_frame && is->auddec.preroll_serial >= 0) {
+			double start = frame->pts == AV_NOPTS_VALUE ? NAN : frame->pts / (double)frame->sample_rate;
+			if (decoder_preroll_drop(&is->auddec, start, start + frame->nb_samples / (double)frame->sample_rate)) {
+				av_frame_unref(frame);
+				continue;
+			}
+		}
+
 		if (got_frame) {
 			tb = (AVRational) { 1, frame->sample_rate };
 
@@ -2167,6 +4783,10 @@ static int audio_thread(void *arg)
 				is->audio_filter_src.channel_layout != dec_channel_layout ||
 				is->audio_filter_src.freq != frame->sample_rate ||
 				is->auddec.pkt_serial != last_serial;
+			speed = is->playback_speed;
+			/* only the first speed change rebuilds the graph, later ones retune the tempo filters */
+			if (speed != 1.0 && !is->audio_tempo[0])
+				reconfigure = 1;
 
 			if (reconfigure) {
 				char buf1[1024], buf2[1024];
@@ -2182,10 +4802,19 @@ static int audio_thread(void *arg)
 				is->audio_filter_src.channel_layout = dec_channel_layout;
 				is->audio_filter_src.freq = frame->sample_rate;
 				last_serial = is->auddec.pkt_serial;
+				is->audio_tempo_speed = speed;
+				anchor_out = anchor_media = out_end = media_end = NAN;
 
 				if ((ret = configure_audio_filters(is, afilters, 1)) < 0)
 					goto the_end;
 			}
+			else if (is->audio_tempo[0] && speed != is->audio_tempo_speed) {
+				if ((ret = set_audio_tempo(is, speed)) < 0)
+					goto the_end;
+				/* the new speed counts from the end of the audio put out so far */
+				anchor_out = out_end;
+				anchor_media = media_end;
+			}
 
 			if ((ret = av_buffersrc_add_frame(is->in_audio_filter, frame)) < 0)
 				goto the_end;
@@ -2200,6 +4829,21 @@ static int audio_thread(void *arg)
 				af->pos = frame->pkt_pos;
 				af->serial = is->auddec.pkt_serial;
 				af->duration = av_q2d((AVRational) { frame->nb_samples, frame->sample_rate });
+#if CONFIG_AVFILTER
+				if (is->audio_tempo[0]) {
+					/* pts and duration in media time, so the audio clock stays comparable with the video */
+					if (!isnan(af->pts)) {
+						if (isnan(anchor_out)) {
+							anchor_out = af->pts;
+							anchor_media = af->pts;
+						}
+						out_end = af->pts + af->duration;
+						af->pts = anchor_media + (af->pts - anchor_out) * is->audio_tempo_speed;
+						media_end = af->pts + af->duration * is->audio_tempo_speed;
+					}
+					af->duration *= is->audio_tempo_speed;
+				}
+#endif
 
 				av_frame_move_ref(af->frame, frame);
 				frame_queue_push(&is->sampq);
@@ -2216,6 +4860,7 @@ static int audio_thread(void *arg)
 the_end:
 #if CONFIG_AVFILTER
 	avfilter_graph_free(&is->agraph);
+	is->audio_tempo[0] = is->audio_tempo[1] = NULL;
 #endif
 	av_frame_free(&frame);
 	return ret;
@@ -2223,6 +4868,8 @@ the_end:
 
 static int decoder_start(Decoder *d, int(*fn)(void *), void *arg)
 {
+	if (decode_scheduler_init(&decode_scheduler) < 0)
+		av_log(NULL, AV_LOG_WARNING, "decode scheduler unavailable, decoding unthrottled\n");
 	packet_queue_start(d->queue);
 	d->decoder_tid = SDL_CreateThread(fn, "decoder", arg);
 	if (!d->decoder_tid) {
@@ -2232,6 +4879,416 @@ static int decoder_start(Decoder *d, int(*fn)(void *), void *arg)
 	return 0;
 }
 
+/*
+ * Size the picture queue so that a decode time of mean + 3 sigma still fits
+ * in the pictures already waiting for display; grow at once, shrink slowly.
+ */
+static void update_picture_queue_size(VideoState *is, double decode_time, double frame_duration)
+{
+	FrameQueue *f = &is->pictq;
+	double diff;
+	int target;
+
+	if (is->decode_time_avg <= 0) {
+		is->decode_time_avg = decode_time;
+	} else {
+		diff = decode_time - is->decode_time_avg;
+		is->decode_time_avg += DECODE_TIME_AVG_COEF * diff;
+		is->decode_time_var = (1.0 - DECODE_TIME_AVG_COEF) * (is->decode_time_var + DECODE_TIME_AVG_COEF * diff * diff);
+	}
+	if (frame_duration <= 0 || isnan(frame_duration))
+		return;
+	if (is->mem.shed_level >= MEM_SHED_FRAME_QUEUE) {
+		is->pictq_shrink_count = 0;
+		return;
+	}
+
+	target = (int)ceil((is->decode_time_avg + 3 * sqrt(is->decode_time_var)) / frame_duration) + 2;
+	if (is->frame_drops_late > is->pictq_drops_seen) {
+		is->pictq_drops_seen = is->frame_drops_late;
+		target = FFMAX(target, f->max_size + 1);
+	}
+	target = av_clip(target, FFMIN(picture_queue_min, f->capacity), f->capacity);
+
+	if (target > f->max_size) {
+		frame_queue_set_max_size(f, target);
+		is->pictq_shrink_count = 0;
+	} else if (target < f->max_size) {
+		if (++is->pictq_shrink_count >= PICTURE_QUEUE_SHRINK_FRAMES) {
+			frame_queue_set_max_size(f, f->max_size - 1);
+			is->pictq_shrink_count = 0;
+		}
+	} else {
+		is->pictq_shrink_count = 0;
+	}
+}
+
+static int reverse_interrupt_cb(void *ctx)
+{
+	ReversePlayer *rv = ctx;
+	return rv->abort;
+}
+
+static void reverse_stash_clear(ReversePlayer *rv, ReverseStash *stash)
+{
+	int i;
+
+	for (i = 0; i < stash->nb_frames; i++)
+		av_frame_free(&stash->frames[i]);
+	mem_account(rv->mem, MEM_FRAMES, -stash->mem_bytes);
+	stash->nb_frames = 0;
+	stash->mem_bytes = 0;
+	stash->ready = 0;
+	stash->eof = 0;
+}
+
+static int64_t reverse_frame_size(AVFrame *frame)
+{
+	int64_t size = 0;
+	int i;
+
+	for (i = 0; i < FF_ARRAY_ELEMS(frame->buf) && frame->buf[i]; i++)
+		size += frame->buf[i]->size;
+	return size;
+}
+
+static int64_t reverse_stash_max_bytes(ReversePlayer *rv)
+{
+	int64_t limit = rv->mem->limit;
+	return limit > 0 ? limit / 4 : REVERSE_STASH_MAX_BYTES;
+}
+
+/* keep the decoded pictures before cursor, dropping the earliest ones once the stash is over its size */
+static int reverse_receive(ReversePlayer *rv, ReverseStash *stash)
+{
+	AVFrame *frame;
+	int ret;
+
+	while ((ret = avcodec_receive_frame(rv->avctx, rv->frame)) >= 0) {
+		int64_t pts = rv->frame->best_effort_timestamp;
+		int64_t size = reverse_frame_size(rv->frame);
+
+		if (pts == AV_NOPTS_VALUE || pts >= rv->cursor) {
+			av_frame_unref(rv->frame);
+			continue;
+		}
+		while (stash->nb_frames >= REVERSE_STASH_FRAMES && stash->mem_bytes + size > reverse_stash_max_bytes(rv)) {
+			int64_t drop = reverse_frame_size(stash->frames[0]);
+			mem_account(rv->mem, MEM_FRAMES, -drop);
+			stash->mem_bytes -= drop;
+			av_frame_free(&stash->frames[0]);
+			memmove(stash->frames, stash->frames + 1, (stash->nb_frames - 1) * sizeof(*stash->frames));
+			stash->nb_frames--;
+		}
+		if (stash->nb_frames == stash->frames_alloc) {
+			int alloc = FFMAX(stash->frames_alloc * 2, REVERSE_STASH_FRAMES);
+			AVFrame **frames = av_realloc_array(stash->frames, alloc, sizeof(*frames));
+			if (!frames) {
+				av_frame_unref(rv->frame);
+				return AVERROR(ENOMEM);
+			}
+			stash->frames = frames;
+			stash->frames_alloc = alloc;
+		}
+		if (!(frame = av_frame_alloc())) {
+			av_frame_unref(rv->frame);
+			return AVERROR(ENOMEM);
+		}
+		av_frame_move_ref(frame, rv->frame);
+		frame->pts = pts;
+		mem_account(rv->mem, MEM_FRAMES, size);
+		stash->mem_bytes += size;
+		stash->frames[stash->nb_frames++] = frame;
+	}
+	return ret == AVERROR(EAGAIN) || ret == AVERROR_EOF ? 0 : ret;
+}
+
+/* decode from the keyframe at or before target up to the next keyframe at or after cursor */
+static int reverse_decode_pass(ReversePlayer *rv, ReverseStash *stash, int64_t target)
+{
+	AVPacket pkt;
+	int ret;
+
+	if ((ret = avformat_seek_file(rv->ic, rv->st->index, INT64_MIN, target, target, 0)) < 0)
+		return ret;
+	avcodec_flush_buffers(rv->avctx);
+
+	while (!rv->abort) {
+		if ((ret = av_read_frame(rv->ic, &pkt)) < 0)
+			break;
+		if (pkt.stream_index != rv->st->index) {
+			av_packet_unref(&pkt);
+			continue;
+		}
+		if ((pkt.flags & AV_PKT_FLAG_KEY) &&
+			(pkt.pts != AV_NOPTS_VALUE ? pkt.pts : pkt.dts) >= rv->cursor) {
+			av_packet_unref(&pkt);
+			break;
+		}
+		ret = avcodec_send_packet(rv->avctx, &pkt);
+		av_packet_unref(&pkt);
+		if (ret < 0 && ret != AVERROR(EAGAIN)) {
+			/* a damaged packet costs a picture or two, not the pass */
+			av_log(NULL, AV_LOG_WARNING, "reverse playback: error decoding a packet: %s\n", av_err2str(ret));
+			continue;
+		}
+		if ((ret = reverse_receive(rv, stash)) < 0)
+			return ret;
+	}
+	/* drain the pictures the decoder still holds back for reordering */
+	avcodec_send_packet(rv->avctx, NULL);
+	return reverse_receive(rv, stash);
+}
+
+static int reverse_thread(void *arg)
+{
+	ReversePlayer *rv = arg;
+	int64_t step = av_rescale_q(AV_TIME_BASE, AV_TIME_BASE_Q, rv->st->time_base);
+	int64_t start = rv->st->start_time != AV_NOPTS_VALUE ? rv->st->start_time : 0;
+	ReverseStash *stash;
+	int64_t target, back;
+	int i, ret;
+
+	for (;;) {
+		SDL_LockMutex(rv->mutex);
+		stash = &rv->stash[rv->decode_index];
+		while (stash->ready && !rv->abort)
+			SDL_CondWait(rv->cond, rv->mutex);
+		SDL_UnlockMutex(rv->mutex);
+		if (rv->abort)
+			break;
+
+		/* a seek can land on a keyframe at or after cursor, back off until a pass yields pictures */
+		ret = 0;
+		for (i = 0, back = FFMAX(step, 1); i < REVERSE_SEEK_ATTEMPTS && !stash->nb_frames && !rv->abort; i++, back *= 2) {
+			target = i ? rv->cursor - back : rv->cursor - 1;
+			if ((ret = reverse_decode_pass(rv, stash, target)) < 0 || target <= start)
+				break;
+		}
+		if (ret < 0 && !rv->abort)
+			av_log(NULL, AV_LOG_WARNING, "reverse playback stopped: %s\n", av_err2str(ret));
+		if (stash->nb_frames)
+			rv->cursor = stash->frames[0]->pts;
+
+		SDL_LockMutex(rv->mutex);
+		stash->eof = !stash->nb_frames;
+		stash->ready = 1;
+		rv->decode_index ^= 1;
+		SDL_CondBroadcast(rv->cond);
+		SDL_UnlockMutex(rv->mutex);
+		if (stash->eof)
+			break;
+	}
+	return 0;
+}
+
+static void reverse_close(ReversePlayer *rv)
+{
+	int i;
+
+	SDL_LockMutex(rv->mutex);
+	rv->abort = 1;
+	SDL_CondBroadcast(rv->cond);
+	SDL_UnlockMutex(rv->mutex);
+	if (rv->tid) {
+		SDL_WaitThread(rv->tid, NULL);
+		rv->tid = NULL;
+	}
+	for (i = 0; i < 2; i++) {
+		reverse_stash_clear(rv, &rv->stash[i]);
+		av_freep(&rv->stash[i].frames);
+		rv->stash[i].frames_alloc = 0;
+	}
+	av_frame_free(&rv->frame);
+	codec_pool_put(&codec_pool, &rv->avctx, &rv->pool_par, rv->pool_threads);
+	avformat_close_input(&rv->ic);
+	rv->st = NULL;
+}
+
+/* open a second demuxer and decoder on the video stream, for pictures before pos */
+static int reverse_open(VideoState *is, double pos)
+{
+	ReversePlayer *rv = &is->rev;
+	AVDictionary *opts = NULL;
+	AVStream *st;
+	int ret, i;
+
+	if (!is->video_st || stream_in_main(is->video_stream) < 0 ||
+		(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+		return AVERROR(ENOSYS);
+
+	rv->abort = 0;
+	rv->decode_index = rv->present_index = 0;
+	rv->mem = &is->mem;
+	if (!(rv->ic = avformat_alloc_context()) || !(rv->frame = av_frame_alloc()))
+		return AVERROR(ENOMEM);
+	rv->ic->interrupt_callback.callback = reverse_interrupt_cb;
+	rv->ic->interrupt_callback.opaque = rv;
+	if ((ret = avformat_open_input(&rv->ic, is->filename, is->iformat, NULL)) < 0)
+		return ret;
+	if (find_stream_info && (ret = avformat_find_stream_info(rv->ic, NULL)) < 0)
+		return ret;
+	if (is->video_stream >= rv->ic->nb_streams ||
+		rv->ic->streams[is->video_stream]->codecpar->codec_id != is->video_st->codecpar->codec_id)
+		return AVERROR_INVALIDDATA;
+	for (i = 0; i < rv->ic->nb_streams; i++)
+		rv->ic->streams[i]->discard = i == is->video_stream ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	rv->st = st = rv->ic->streams[is->video_stream];
+
+	rv->pool_threads = decode_scheduler_codec_threads(&decode_scheduler, AVMEDIA_TYPE_VIDEO);
+	if (!(rv->pool_par = avcodec_parameters_alloc()))
+		return AVERROR(ENOMEM);
+	if ((ret = avcodec_parameters_copy(rv->pool_par, st->codecpar)) < 0)
+		return ret;
+	rv->avctx = codec_pool_get(&codec_pool, is->viddec.avctx->codec, st->codecpar, rv->pool_threads, 0, 0);
+	if (rv->avctx) {
+		rv->avctx->pkt_timebase = st->time_base;
+	}
+	else {
+		if (!(rv->avctx = avcodec_alloc_context3(NULL)))
+			return AVERROR(ENOMEM);
+		if ((ret = avcodec_parameters_to_context(rv->avctx, st->codecpar)) < 0)
+			return ret;
+		rv->avctx->pkt_timebase = st->time_base;
+		av_dict_set_int(&opts, "threads", rv->pool_threads, 0);
+		av_dict_set(&opts, "refcounted_frames", "1", 0);
+		ret = avcodec_open2(rv->avctx, is->viddec.avctx->codec, &opts);
+		av_dict_free(&opts);
+		if (ret < 0)
+			return ret;
+	}
+
+	rv->cursor = isnan(pos) ? INT64_MAX : av_rescale_q((int64_t)(pos * AV_TIME_BASE), AV_TIME_BASE_Q, st->time_base);
+	if (!(rv->tid = SDL_CreateThread(reverse_thread, "reverse", rv)))
+		return AVERROR(ENOMEM);
+	return 0;
+}
+
+/* run by video_thread for as long as reverse playback is on */
+static int reverse_play(VideoState *is)
+{
+	ReversePlayer *rv = &is->rev;
+	AVRational frame_rate;
+	double duration;
+	ReverseStash *stash;
+	int i, eof, ret;
+
+	if ((ret = reverse_open(is, is->reverse_pos)) < 0) {
+		av_log(NULL, AV_LOG_WARNING, "reverse playback unavailable: %s\n", av_err2str(ret));
+		reverse_close(rv);
+		/* read_thread leaves reverse mode and seeks back to where it started */
+		is->reverse_req = 0;
+		read_wake_signal(&is->continue_read_thread);
+		SDL_LockMutex(rv->mutex);
+		while (is->reverse && !is->videoq.abort_request)
+			SDL_CondWait(rv->cond, rv->mutex);
+		SDL_UnlockMutex(rv->mutex);
+		return 0;
+	}
+	frame_rate = av_guess_frame_rate(rv->ic, rv->st, NULL);
+	duration = frame_rate.num && frame_rate.den ? av_q2d(av_inv_q(frame_rate)) : 1.0 / 25;
+	set_clock_speed(&is->vidclk, -is->speed);
+
+	ret = 0;
+	while (is->reverse && !is->videoq.abort_request && ret >= 0) {
+		SDL_LockMutex(rv->mutex);
+		stash = &rv->stash[rv->present_index];
+		while (!stash->ready && is->reverse && !is->videoq.abort_request)
+			SDL_CondWait(rv->cond, rv->mutex);
+		SDL_UnlockMutex(rv->mutex);
+		if (!stash->ready)
+			break;
+
+		for (i = stash->nb_frames - 1; i >= 0 && is->reverse && ret >= 0; i--) {
+			AVFrame *frame = stash->frames[i];
+			frame->sample_aspect_ratio = av_guess_sample_aspect_ratio(rv->ic, rv->st, frame);
+			ret = queue_picture(is, frame, frame->pts * av_q2d(rv->st->time_base), duration,
+				frame->pkt_pos, is->videoq.serial);
+		}
+
+		SDL_LockMutex(rv->mutex);
+		eof = stash->eof;
+		reverse_stash_clear(rv, stash);
+		rv->present_index ^= 1;
+		SDL_CondBroadcast(rv->cond);
+		/* stay on the first picture until reverse playback is turned off */
+		while (eof && is->reverse && !is->videoq.abort_request)
+			SDL_CondWait(rv->cond, rv->mutex);
+		SDL_UnlockMutex(rv->mutex);
+	}
+
+	set_clock_speed(&is->vidclk, is->speed);
+	reverse_close(rv);
+	return ret;
+}
+
+/*
+ * Drop decode quality a step when the video decoder was busy for more than
+ * DECODE_QUALITY_DEGRADE of the last interval, before frames get dropped
+ * after a full decode; recover a step after a few calm intervals.
+ */
+static void update_decode_quality(VideoState *is, double decode_time)
+{
+	double now = av_gettime_relative() / 1000000.0;
+	double elapsed = now - is->quality_window_start;
+	int enabled = framedrop > 0 || (framedrop && get_master_sync_type(is) != AV_SYNC_VIDEO_MASTER);
+	int level = is->viddec.quality;
+	double load;
+
+	/* a pause or a stall makes the window meaningless */
+	if (elapsed > 2 * DECODE_QUALITY_INTERVAL) {
+		is->quality_window_start = now;
+		is->quality_busy = 0;
+		return;
+	}
+	is->quality_busy += decode_time;
+	if (elapsed < DECODE_QUALITY_INTERVAL)
+		return;
+	load = is->quality_busy / elapsed;
+	is->quality_window_start = now;
+	is->quality_busy = 0;
+
+	if (!enabled) {
+		level = 0;
+	}
+	else if (load > DECODE_QUALITY_DEGRADE && level < decode_quality_max) {
+		level++;
+		is->quality_calm = 0;
+	}
+	else if (load < DECODE_QUALITY_RECOVER && level > 0) {
+		if (++is->quality_calm >= DECODE_QUALITY_RECOVER_INTERVALS) {
+			level--;
+			is->quality_calm = 0;
+		}
+	}
+	else {
+		is->quality_calm = 0;
+	}
+	level = FFMIN(level, decode_quality_max);
+	if (level == is->viddec.quality)
+		return;
+
+	av_log(NULL, AV_LOG_VERBOSE, "decode quality %d -> %d at %0.0f%% decoder load\n",
+		is->viddec.quality, level, load * 100);
+	is->viddec.quality = level;
+	is->quality_changes++;
+	decoder_update_discard(&is->viddec);
+	if (on_decode_quality != NULL)
+		on_decode_quality(level, (int)(load * 100));
+}
+
+/* pictures the decoder can leave out at the playback speed, they would hardly be on screen */
+static enum AVDiscard video_speed_skip(VideoState *is, AVRational frame_rate)
+{
+	if (is->speed <= 1.0)
+		return AVDISCARD_DEFAULT;
+	if (is->speed >= SPEED_KEYFRAMES_ONLY)
+		return AVDISCARD_NONKEY;
+	if (!frame_rate.num || !frame_rate.den || av_q2d(av_inv_q(frame_rate)) / is->speed < SPEED_MIN_PICTURE_INTERVAL)
+		return AVDISCARD_NONREF;
+	return AVDISCARD_DEFAULT;
+}
+
 static int video_thread(void *arg)
 {
 	VideoState *is = arg;
@@ -2241,6 +5298,8 @@ static int video_thread(void *arg)
 	int ret;
 	AVRational tb = is->video_st->time_base;
 	AVRational frame_rate = av_guess_frame_rate(is->ic, is->video_st, NULL);
+	int64_t decode_start;
+	int had_packets;
 
 #if CONFIG_AVFILTER
 	AVFilterGraph *graph = avfilter_graph_alloc();
@@ -2265,11 +5324,31 @@ static int video_thread(void *arg)
 	}
 
 	for (;;) {
+		if (is->reverse) {
+			if (reverse_play(is) < 0)
+				goto the_end;
+			continue;
+		}
+		if (is->viddec.keyframes_only != !!is->trick_rate ||
+			is->viddec.speed_skip != video_speed_skip(is, frame_rate)) {
+			is->viddec.keyframes_only = !!is->trick_rate;
+			is->viddec.speed_skip = video_speed_skip(is, frame_rate);
+			decoder_update_discard(&is->viddec);
+		}
+		/* time spent starved for packets says nothing about the decoder */
+		had_packets = packet_queue_nb_packets(&is->videoq) > 0;
+		decode_start = av_gettime_relative();
 		ret = get_video_frame(is, frame);
 		if (ret < 0)
 			goto the_end;
 		if (!ret)
 			continue;
+		if (had_packets) {
+			double decode_time = (av_gettime_relative() - decode_start) / 1000000.0;
+			if (frame_rate.num && frame_rate.den)
+				update_picture_queue_size(is, decode_time, av_q2d((AVRational) { frame_rate.den, frame_rate.num }));
+			update_decode_quality(is, decode_time);
+		}
 
 #if CONFIG_AVFILTER
 		if (last_w != frame->width
@@ -2343,6 +5422,47 @@ the_end:
 	return 0;
 }
 
+/*
+ * Convert the PAL8 rects of a bitmap subtitle to the texture format through
+ * their palette, so the display only uploads them. The palette is native
+ * endian ARGB like the texture, so it serves as the lookup table as is.
+ */
+static int subtitle_rasterize(Frame *sp)
+{
+	AVSubtitle *sub = &sp->sub;
+	int i, x, y;
+
+	if (!sub->num_rects)
+		return 0;
+	if (!(sp->sub_bitmaps = av_mallocz_array(sub->num_rects, sizeof(*sp->sub_bitmaps))))
+		return AVERROR(ENOMEM);
+	for (i = 0; i < sub->num_rects; i++) {
+		AVSubtitleRect *sub_rect = sub->rects[i];
+		SubtitleBitmap *bm = &sp->sub_bitmaps[i];
+		uint32_t lut[256] = { 0 };
+
+		if (sub_rect->type != SUBTITLE_BITMAP || sub_rect->w <= 0 || sub_rect->h <= 0 ||
+			!sub_rect->data[0] || !sub_rect->data[1])
+			continue;
+		memcpy(lut, sub_rect->data[1], av_clip(sub_rect->nb_colors, 0, 256) * sizeof(*lut));
+		bm->pitch = sub_rect->w * 4;
+		bm->size = bm->pitch * sub_rect->h;
+		if (!(bm->pixels = av_malloc(bm->size)))
+			return AVERROR(ENOMEM);
+		for (y = 0; y < sub_rect->h; y++) {
+			const uint8_t *src = sub_rect->data[0] + y * sub_rect->linesize[0];
+			uint32_t *dst = bm->pixels + y * sub_rect->w;
+			for (x = 0; x < sub_rect->w; x++)
+				dst[x] = lut[src[x]];
+		}
+		/* the indexed picture is not needed any more */
+		av_freep(&sub_rect->data[0]);
+		av_freep(&sub_rect->data[1]);
+		sub_rect->linesize[0] = 0;
+	}
+	return 0;
+}
+
 static int subtitle_thread(void *arg)
 {
 	VideoState *is = arg;
@@ -2368,6 +5488,12 @@ static int subtitle_thread(void *arg)
 			sp->height = is->subdec.avctx->height;
 			sp->uploaded = 0;
 
+			if (subtitle_rasterize(sp) < 0) {
+				av_log(NULL, AV_LOG_WARNING, "dropping a subtitle, out of memory\n");
+				frame_queue_unref_item(sp);
+				continue;
+			}
+
 			/* now we can update the picture count */
 			frame_queue_push(&is->subpq);
 		}
@@ -2421,7 +5547,7 @@ static int synchronize_audio(VideoState *is, int nb_samples)
 				avg_diff = is->audio_diff_cum * (1.0 - is->audio_diff_avg_coef);
 
 				if (fabs(avg_diff) >= is->audio_diff_threshold) {
-					wanted_nb_samples = nb_samples + (int)(diff * is->audio_src.freq);
+					wanted_nb_samples = nb_samples + (int)(diff / is->playback_speed * is->audio_src.freq);
 					min_nb_samples = ((nb_samples * (100 - SAMPLE_CORRECTION_PERCENT_MAX) / 100));
 					max_nb_samples = ((nb_samples * (100 + SAMPLE_CORRECTION_PERCENT_MAX) / 100));
 					wanted_nb_samples = av_clip(wanted_nb_samples, min_nb_samples, max_nb_samples);
@@ -2457,7 +5583,7 @@ static int audio_decode_frame(VideoState *is)
 	int wanted_nb_samples;
 	Frame *af;
 
-	if (is->paused)
+	if (is->paused || is->reverse || is->trick_rate)
 		return -1;
 
 	do {
@@ -2546,7 +5672,7 @@ static int audio_decode_frame(VideoState *is)
 	audio_clock0 = is->audio_clock;
 	/* update the audio clock with the pts */
 	if (!isnan(af->pts))
-		is->audio_clock = af->pts + (double)af->frame->nb_samples / af->frame->sample_rate;
+		is->audio_clock = af->pts + af->duration;
 	else
 		is->audio_clock = NAN;
 	is->audio_clock_serial = af->serial;
@@ -2602,7 +5728,7 @@ static void sdl_audio_callback(void *opaque, Uint8 *stream, int len)
 	is->audio_write_buf_size = is->audio_buf_size - is->audio_buf_index;
 	/* Let's assume the audio driver that is used by SDL has two periods. */
 	if (!isnan(is->audio_clock)) {
-		set_clock_at(&is->audclk, is->audio_clock - (double)(2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, is->audio_clock_serial, audio_callback_time / 1000000.0);
+		set_clock_at(&is->audclk, is->audio_clock - is->playback_speed * (2 * is->audio_hw_buf_size + is->audio_write_buf_size) / is->audio_tgt.bytes_per_sec, is->audio_clock_serial, audio_callback_time / 1000000.0);
 		sync_clock_to_slave(&is->extclk, &is->audclk);
 	}
 }
@@ -2683,28 +5809,34 @@ static int audio_open(void *opaque, int64_t wanted_channel_layout, int wanted_nb
 /* open a given stream. Return 0 if OK */
 static int stream_component_open(VideoState *is, int stream_index)
 {
-	AVFormatContext *ic = is->ic;
+	AVFormatContext *ic;
+	AVStream *st = stream_lookup(is, stream_index, &ic);
+	ReadWake *wake = stream_index >= EXTERNAL_STREAM_BASE ?
+		&is->ext[stream_index - EXTERNAL_STREAM_BASE].wake : &is->continue_read_thread;
 	AVCodecContext *avctx;
 	AVCodec *codec;
 	const char *forced_codec_name = NULL;
 	AVDictionary *opts = NULL;
 	AVDictionaryEntry *t = NULL;
+	AVCodecContext *pooled = NULL;
+	AVCodecParameters *pool_par = NULL;
+	int pool_threads = 0;
 	int sample_rate, nb_channels;
 	int64_t channel_layout;
 	int ret = 0;
 	int stream_lowres = lowres;
 
-	if (stream_index < 0 || stream_index >= ic->nb_streams)
+	if (!st)
 		return -1;
 
 	avctx = avcodec_alloc_context3(NULL);
 	if (!avctx)
 		return AVERROR(ENOMEM);
 
-	ret = avcodec_parameters_to_context(avctx, ic->streams[stream_index]->codecpar);
+	ret = avcodec_parameters_to_context(avctx, st->codecpar);
 	if (ret < 0)
 		goto fail;
-	avctx->pkt_timebase = ic->streams[stream_index]->time_base;
+	avctx->pkt_timebase = st->time_base;
 
 	codec = avcodec_find_decoder(avctx->codec_id);
 
@@ -2735,24 +5867,40 @@ static int stream_component_open(VideoState *is, int stream_index)
 	if (fast)
 		avctx->flags2 |= AV_CODEC_FLAG2_FAST;
 
-	opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, ic->streams[stream_index], codec);
-	if (!av_dict_get(opts, "threads", NULL, 0))
-		av_dict_set(&opts, "threads", "auto", 0);
-	if (stream_lowres)
-		av_dict_set_int(&opts, "lowres", stream_lowres, 0);
-	if (avctx->codec_type == AVMEDIA_TYPE_VIDEO || avctx->codec_type == AVMEDIA_TYPE_AUDIO)
-		av_dict_set(&opts, "refcounted_frames", "1", 0);
-	if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
-		goto fail;
+	opts = filter_codec_opts(codec_opts, avctx->codec_id, ic, st, codec);
+	if ((avctx->codec_type == AVMEDIA_TYPE_VIDEO || avctx->codec_type == AVMEDIA_TYPE_AUDIO) && !av_dict_count(opts)) {
+		/* a decoder left open by an earlier stream like this one skips the open and its thread start */
+		pool_threads = decode_scheduler_codec_threads(&decode_scheduler, avctx->codec_type);
+		if (!(pool_par = avcodec_parameters_alloc()) || (ret = avcodec_parameters_copy(pool_par, st->codecpar)) < 0) {
+			ret = pool_par ? ret : AVERROR(ENOMEM);
+			goto fail;
+		}
+		pooled = codec_pool_get(&codec_pool, codec, st->codecpar, pool_threads, avctx->lowres, avctx->flags2);
 	}
-	if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
-		av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
-		ret = AVERROR_OPTION_NOT_FOUND;
-		goto fail;
+	if (pooled) {
+		avcodec_free_context(&avctx);
+		avctx = pooled;
+		avctx->pkt_timebase = st->time_base;
+	}
+	else {
+		if (!av_dict_get(opts, "threads", NULL, 0))
+			av_dict_set_int(&opts, "threads", decode_scheduler_codec_threads(&decode_scheduler, avctx->codec_type), 0);
+		if (stream_lowres)
+			av_dict_set_int(&opts, "lowres", stream_lowres, 0);
+		if (avctx->codec_type == AVMEDIA_TYPE_VIDEO || avctx->codec_type == AVMEDIA_TYPE_AUDIO)
+			av_dict_set(&opts, "refcounted_frames", "1", 0);
+		if ((ret = avcodec_open2(avctx, codec, &opts)) < 0) {
+			goto fail;
+		}
+		if ((t = av_dict_get(opts, "", NULL, AV_DICT_IGNORE_SUFFIX))) {
+			av_log(NULL, AV_LOG_ERROR, "Option %s not found.\n", t->key);
+			ret = AVERROR_OPTION_NOT_FOUND;
+			goto fail;
+		}
 	}
 
 	is->eof = 0;
-	ic->streams[stream_index]->discard = AVDISCARD_DEFAULT;
+	st->discard = AVDISCARD_DEFAULT;
 	switch (avctx->codec_type) {
 	case AVMEDIA_TYPE_AUDIO:
 #if CONFIG_AVFILTER
@@ -2792,10 +5940,14 @@ static int stream_component_open(VideoState *is, int stream_index)
 		is->audio_diff_threshold = (double)(is->audio_hw_buf_size) / is->audio_tgt.bytes_per_sec;
 
 		is->audio_stream = stream_index;
-		is->audio_st = ic->streams[stream_index];
-
-		decoder_init(&is->auddec, avctx, &is->audioq, is->continue_read_thread);
-		if ((is->ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK)) && !is->ic->iformat->read_seek) {
+		is->audio_st = st;
+		is->audioq.time_base = is->audio_st->time_base;
+
+		decoder_init(&is->auddec, avctx, &is->audioq, &is->sampq, wake);
+		is->auddec.pool_par = pool_par;
+		is->auddec.pool_threads = pool_threads;
+		pool_par = NULL;
+		if ((ic->iformat->flags & (AVFMT_NOBINSEARCH | AVFMT_NOGENSEARCH | AVFMT_NO_BYTE_SEEK)) && !ic->iformat->read_seek) {
 			is->auddec.start_pts = is->audio_st->start_time;
 			is->auddec.start_pts_tb = is->audio_st->time_base;
 		}
@@ -2805,18 +5957,23 @@ static int stream_component_open(VideoState *is, int stream_index)
 		break;
 	case AVMEDIA_TYPE_VIDEO:
 		is->video_stream = stream_index;
-		is->video_st = ic->streams[stream_index];
+		is->video_st = st;
+		is->videoq.time_base = is->video_st->time_base;
 
-		decoder_init(&is->viddec, avctx, &is->videoq, is->continue_read_thread);
+		decoder_init(&is->viddec, avctx, &is->videoq, &is->pictq, wake);
+		is->viddec.pool_par = pool_par;
+		is->viddec.pool_threads = pool_threads;
+		pool_par = NULL;
 		if ((ret = decoder_start(&is->viddec, video_thread, is)) < 0)
 			goto out;
 		is->queue_attachments_req = 1;
 		break;
 	case AVMEDIA_TYPE_SUBTITLE:
 		is->subtitle_stream = stream_index;
-		is->subtitle_st = ic->streams[stream_index];
+		is->subtitle_st = st;
+		is->subtitleq.time_base = is->subtitle_st->time_base;
 
-		decoder_init(&is->subdec, avctx, &is->subtitleq, is->continue_read_thread);
+		decoder_init(&is->subdec, avctx, &is->subtitleq, &is->subpq, wake);
 		if ((ret = decoder_start(&is->subdec, subtitle_thread, is)) < 0)
 			goto out;
 		break;
@@ -2828,6 +5985,7 @@ static int stream_component_open(VideoState *is, int stream_index)
 fail:
 	avcodec_free_context(&avctx);
 out:
+	avcodec_parameters_free(&pool_par);
 	av_dict_free(&opts);
 
 	return ret;
@@ -2839,11 +5997,25 @@ static int decode_interrupt_cb(void *ctx)
 	return is->abort_request;
 }
 
-static int stream_has_enough_packets(AVStream *st, int stream_id, PacketQueue *queue) {
-	return stream_id < 0 ||
+/*
+ * update the refill state of a stream, return 1 while read_thread should keep reading for it;
+ * with short_read_ahead only the low watermark is kept filled
+ */
+static int stream_wants_packets(AVStream *st, int stream_id, PacketQueue *queue, int short_read_ahead) {
+	if (stream_id < 0 ||
 		queue->abort_request ||
-		(st->disposition & AV_DISPOSITION_ATTACHED_PIC) ||
-		queue->nb_packets > MIN_FRAMES && (!queue->duration || av_q2d(st->time_base) * queue->duration > 1.0);
+		(st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+		return 0;
+	if (packet_queue_above_high(queue) || (short_read_ahead && !packet_queue_below_low(queue)))
+		SDL_AtomicSet(&queue->filling, 0);
+	else if (packet_queue_below_low(queue))
+		SDL_AtomicSet(&queue->filling, 1);
+	return SDL_AtomicGet(&queue->filling);
+}
+
+static int stream_over_limit(int stream_id, PacketQueue *queue) {
+	return stream_id >= 0 &&
+		(packet_queue_full(queue) || packet_queue_size(queue) >= queue->wm.high_bytes);
 }
 
 static int is_realtime(AVFormatContext *s)
@@ -2862,6 +6034,338 @@ static int is_realtime(AVFormatContext *s)
 	return 0;
 }
 
+/*
+ * Shed or restore one step at a time while the player is over its memory
+ * budget or back under MEM_RELAX_RATIO of it: first the retained packets,
+ * then the extra picture queue slots, then the read-ahead: the packets above
+ * the low watermarks and the read-ahead chunks above the minimum window.
+ */
+static void update_memory_budget(VideoState *is)
+{
+	MemoryBudget *mem = &is->mem;
+	int64_t used;
+	int level = mem->shed_level;
+	double now = av_gettime_relative() / 1000000.0;
+
+	if (!mem->limit) {
+		level = MEM_SHED_NONE;
+	}
+	else if (now - mem->last_shed_change >= MEM_SHED_INTERVAL) {
+		used = mem_used(mem, -1);
+		if (used > mem->limit && level < MEM_SHED_READ_AHEAD)
+			level++;
+		else if (used < mem->limit * MEM_RELAX_RATIO && level > MEM_SHED_NONE)
+			level--;
+	}
+	if (level == mem->shed_level)
+		return;
+
+	av_log(NULL, AV_LOG_VERBOSE, "memory budget: %"PRId64" of %"PRId64" bytes used, shed level %d -> %d\n",
+		mem_used(mem, -1), mem->limit, mem->shed_level, level);
+	mem->shed_level = level;
+	mem->last_shed_change = now;
+	SDL_AtomicSet(&is->videoq.retain_shed, level >= MEM_SHED_RETENTION);
+	SDL_AtomicSet(&is->audioq.retain_shed, level >= MEM_SHED_RETENTION);
+	SDL_AtomicSet(&is->subtitleq.retain_shed, level >= MEM_SHED_RETENTION);
+	if (level >= MEM_SHED_FRAME_QUEUE && is->pictq.queue)
+		frame_queue_set_max_size(&is->pictq, picture_queue_min);
+	if (is->read_ahead)
+		read_ahead_shed(is->read_ahead, level >= MEM_SHED_READ_AHEAD);
+}
+
+/*
+ * Serve a time seek from the queued or retained packets when every audio
+ * and video queue reaches the target; the demuxer keeps reading where it was.
+ */
+static int stream_seek_buffered(VideoState *is, int64_t target)
+{
+	if (is->seek_flags & AVSEEK_FLAG_BYTE)
+		return 0;
+	if (is->video_st && (is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC))
+		return 0;
+	if (is->video_st &&
+		!packet_queue_covers(&is->videoq, av_rescale_q(target, AV_TIME_BASE_Q, is->video_st->time_base)))
+		return 0;
+	if (is->audio_st &&
+		!packet_queue_covers(&is->audioq, av_rescale_q(target, AV_TIME_BASE_Q, is->audio_st->time_base)))
+		return 0;
+	if (!is->video_st && !is->audio_st)
+		return 0;
+
+	if (is->video_st)
+		packet_queue_skip(&is->videoq, av_rescale_q(target, AV_TIME_BASE_Q, is->video_st->time_base));
+	if (is->audio_st)
+		packet_queue_skip(&is->audioq, av_rescale_q(target, AV_TIME_BASE_Q, is->audio_st->time_base));
+	if (is->subtitle_st)
+		packet_queue_skip(&is->subtitleq, av_rescale_q(target, AV_TIME_BASE_Q, is->subtitle_st->time_base));
+	return 1;
+}
+
+/* seek the demuxer, straight to the indexed keyframe byte offset when the keyframe index knows one */
+static int stream_seek_demuxer(VideoState *is, int64_t target, int64_t min, int64_t max)
+{
+	int64_t pos;
+
+	if (!(is->seek_flags & AVSEEK_FLAG_BYTE) && keyframe_index_lookup(&is->kf_index, target, &pos) &&
+		avformat_seek_file(is->ic, -1, INT64_MIN, pos, INT64_MAX, AVSEEK_FLAG_BYTE) >= 0) {
+		is->seek_indexed_count++;
+		return 0;
+	}
+	return avformat_seek_file(is->ic, -1, min, target, max, is->seek_flags);
+}
+
+static int external_input_open(VideoState *is, ExternalInput *ext, enum AVMediaType type, const char *url)
+{
+	AVFormatContext *ic;
+	AVPacket pkt;
+	int64_t size;
+	int ret, i;
+
+	ext->is = is;
+	ext->type = type;
+	ext->queue = type == AVMEDIA_TYPE_AUDIO ? &is->audioq : &is->subtitleq;
+	if (!(ext->mutex = SDL_CreateMutex()) || read_wake_init(&ext->wake) < 0)
+		return AVERROR(ENOMEM);
+
+	if (!(ic = avformat_alloc_context()))
+		return AVERROR(ENOMEM);
+	ic->interrupt_callback.callback = decode_interrupt_cb;
+	ic->interrupt_callback.opaque = is;
+	if (mapped_io && mapped_avio_open(&ext->mapped_pb, url) == 0) {
+		ic->pb = ext->mapped_pb;
+		ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
+	if ((ret = avformat_open_input(&ic, url, NULL, NULL)) < 0)
+		return ret;
+	ext->ic = ic;
+	if (find_stream_info && (ret = avformat_find_stream_info(ic, NULL)) < 0)
+		return ret;
+	if ((ret = av_find_best_stream(ic, type, -1, -1, NULL, 0)) < 0)
+		return ret;
+	ext->st = ic->streams[ret];
+	for (i = 0; i < ic->nb_streams; i++)
+		ic->streams[i]->discard = ic->streams[i] == ext->st ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	/* dubs and subtitle files start at zero, put that on the start of the main input */
+	ext->ts_offset = is->ic->start_time != AV_NOPTS_VALUE ? is->ic->start_time : 0;
+
+	size = ic->pb ? avio_size(ic->pb) : -1;
+	if (type != AVMEDIA_TYPE_SUBTITLE || size < 0 || size > EXTERNAL_SUBTITLE_MEMORY_MAX)
+		return 0;
+
+	/* demux the whole file once, seeks then only move next_packet */
+	while ((ret = av_read_frame(ic, &pkt)) >= 0) {
+		AVPacket *packets;
+
+		if (pkt.stream_index != ext->st->index) {
+			av_packet_unref(&pkt);
+			continue;
+		}
+		packets = av_fast_realloc(ext->packets, &ext->packets_alloc, (ext->nb_packets + 1) * sizeof(*packets));
+		if (!packets) {
+			av_packet_unref(&pkt);
+			return AVERROR(ENOMEM);
+		}
+		ext->packets = packets;
+		ext->packets[ext->nb_packets++] = pkt;
+	}
+	if (ret != AVERROR_EOF)
+		return ret;
+	if (!ext->packets) {
+		/* an empty file still needs an end, a NULL array would send the reader to the demuxer */
+		if (!(ext->packets = av_mallocz(sizeof(*ext->packets))))
+			return AVERROR(ENOMEM);
+	}
+	av_log(NULL, AV_LOG_VERBOSE, "%s: %d subtitle packets loaded into memory\n", url, ext->nb_packets);
+	return 0;
+}
+
+static int external_input_read(ExternalInput *ext, AVPacket *pkt)
+{
+	int64_t offset;
+	int ret;
+
+	if (ext->packets) {
+		if (ext->next_packet >= ext->nb_packets)
+			return AVERROR_EOF;
+		ret = av_packet_ref(pkt, &ext->packets[ext->next_packet++]);
+	}
+	else {
+		ret = av_read_frame(ext->ic, pkt);
+	}
+	if (ret < 0 || !ext->ts_offset)
+		return ret;
+
+	offset = av_rescale_q(ext->ts_offset, AV_TIME_BASE_Q, ext->ic->streams[pkt->stream_index]->time_base);
+	if (pkt->pts != AV_NOPTS_VALUE)
+		pkt->pts += offset;
+	if (pkt->dts != AV_NOPTS_VALUE)
+		pkt->dts += offset;
+	return ret;
+}
+
+/* move to the main input time target, landing at or before it; caller holds ext->mutex */
+static int external_input_seek(ExternalInput *ext, int64_t target)
+{
+	int64_t ts = target - ext->ts_offset;
+	int i;
+
+	ext->eof = 0;
+	if (!ext->packets)
+		return avformat_seek_file(ext->ic, -1, INT64_MIN, ts, ts, 0);
+
+	/* first subtitle still on screen at ts */
+	ts = av_rescale_q(ts, AV_TIME_BASE_Q, ext->st->time_base);
+	for (i = 0; i < ext->nb_packets; i++) {
+		AVPacket *pkt = &ext->packets[i];
+		if (pkt->pts == AV_NOPTS_VALUE || pkt->pts + FFMAX(pkt->duration, 0) >= ts)
+			break;
+	}
+	ext->next_packet = i;
+	return 0;
+}
+
+/*
+ * demux one external input into its queue, with the same backpressure read_thread uses;
+ * subtitles have no watermarks to fill towards and are only held back by the queue cap
+ */
+static int external_read_thread(void *arg)
+{
+	ExternalInput *ext = arg;
+	VideoState *is = ext->is;
+	int stream_id = EXTERNAL_STREAM_BASE + (ext->type == AVMEDIA_TYPE_AUDIO ? EXTERNAL_AUDIO : EXTERNAL_SUBTITLE);
+	AVPacket pkt1, *pkt = &pkt1;
+	int ret, wait;
+
+	while (!is->abort_request) {
+		wait = -1;
+		SDL_LockMutex(ext->mutex);
+		if ((ext->type == AVMEDIA_TYPE_AUDIO ? is->audio_stream : is->subtitle_stream) == stream_id && !ext->eof &&
+			!stream_over_limit(stream_id, ext->queue) &&
+			(ext->type == AVMEDIA_TYPE_SUBTITLE ||
+			 stream_wants_packets(ext->st, stream_id, ext->queue, is->mem.shed_level >= MEM_SHED_READ_AHEAD))) {
+			ret = external_input_read(ext, pkt);
+			if (ret >= 0) {
+				wait = 0;
+				if (pkt->stream_index == ext->st->index)
+					packet_queue_put(ext->queue, pkt);
+				else
+					av_packet_unref(pkt);
+			}
+			else if (ret == AVERROR_EOF || (ext->ic->pb && (avio_feof(ext->ic->pb) || ext->ic->pb->error))) {
+				packet_queue_put_nullpacket(ext->queue, ext->st->index);
+				ext->eof = 1;
+			}
+			else {
+				wait = READ_THREAD_RETRY_WAIT;
+			}
+		}
+		SDL_UnlockMutex(ext->mutex);
+		if (wait)
+			read_wake_wait(&ext->wake, wait);
+	}
+	return 0;
+}
+
+/* hold every external reader off its queue while read_thread seeks and flushes */
+static void external_inputs_lock(VideoState *is)
+{
+	int i;
+
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++)
+		if (is->ext[i].tid)
+			SDL_LockMutex(is->ext[i].mutex);
+}
+
+static void external_inputs_unlock(VideoState *is)
+{
+	int i;
+
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++) {
+		if (is->ext[i].tid) {
+			SDL_UnlockMutex(is->ext[i].mutex);
+			read_wake_signal(&is->ext[i].wake);
+		}
+	}
+}
+
+/* byte seeks have no meaning in another file, its reader carries on from where it is */
+static void external_inputs_seek(VideoState *is, int64_t target)
+{
+	int i;
+
+	if (is->seek_flags & AVSEEK_FLAG_BYTE)
+		return;
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++) {
+		if (is->ext[i].tid && external_input_seek(&is->ext[i], target) < 0)
+			av_log(NULL, AV_LOG_WARNING, "%s: error while seeking\n", is->ext[i].ic->url);
+	}
+}
+
+/*
+ * Trick play queues the video keyframes at least trick_step apart in the
+ * play direction and drops every other packet. Seekable inputs get to the
+ * next keyframe with a demuxer seek instead of reading the GOPs in between;
+ * rewinding always seeks.
+ */
+static int trick_play_wants(VideoState *is, AVPacket *pkt)
+{
+	int64_t ts, start;
+
+	if (pkt->stream_index != is->video_stream || !(pkt->flags & AV_PKT_FLAG_KEY))
+		return 0;
+	ts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
+	if (ts == AV_NOPTS_VALUE)
+		return 0;
+	ts = av_rescale_q(ts, is->video_st->time_base, AV_TIME_BASE_Q);
+
+	if (is->trick_rate > 0) {
+		if (is->trick_last != AV_NOPTS_VALUE &&
+			ts < is->trick_last + (is->trick_seekable ? 1 : is->trick_step))
+			return 0;
+		is->trick_last = ts;
+		if (is->trick_seekable) {
+			is->trick_target = ts + is->trick_step;
+			is->trick_seek = 1;
+		}
+		return 1;
+	}
+
+	/* a keyframe at or after the last one means the seek went back less than a GOP */
+	start = is->ic->start_time != AV_NOPTS_VALUE ? is->ic->start_time : 0;
+	if (is->trick_last != AV_NOPTS_VALUE && ts >= is->trick_last) {
+		if (is->trick_target <= start) {
+			is->trick_done = 1;
+			return 0;
+		}
+		is->trick_target = FFMAX(is->trick_target - is->trick_step, start);
+		is->trick_seek = 1;
+		return 0;
+	}
+	is->trick_last = ts;
+	is->trick_target = FFMAX(ts - is->trick_step, start);
+	is->trick_seek = 1;
+	return 1;
+}
+
+static void trick_play_seek(VideoState *is)
+{
+	int64_t target = is->trick_target;
+	int ret;
+
+	is->trick_seek = 0;
+	if (is->trick_rate > 0)
+		ret = avformat_seek_file(is->ic, -1, target, target, INT64_MAX, 0);
+	else
+		ret = avformat_seek_file(is->ic, -1, INT64_MIN, target, target, 0);
+	if (ret >= 0)
+		return;
+	/* nothing to seek to: read through to the end, or stop at the start */
+	if (is->trick_rate > 0)
+		is->trick_seekable = 0;
+	else
+		is->trick_done = 1;
+}
+
 /* this thread gets the stream from the disk or the network */
 static int read_thread(void *arg)
 {
@@ -2873,15 +6377,9 @@ static int read_thread(void *arg)
 	int64_t stream_start_time;
 	int pkt_in_play_range = 0;
 	AVDictionaryEntry *t;
-	SDL_mutex *wait_mutex = SDL_CreateMutex();
 	int scan_all_pmts_set = 0;
 	int64_t pkt_ts;
-
-	if (!wait_mutex) {
-		av_log(NULL, AV_LOG_FATAL, "SDL_CreateMutex(): %s\n", SDL_GetError());
-		ret = AVERROR(ENOMEM);
-		goto fail;
-	}
+	ReadAhead *read_ahead = NULL;
 
 	memset(st_index, -1, sizeof(st_index));
 	is->last_video_stream = is->video_stream = -1;
@@ -2902,6 +6400,20 @@ static int read_thread(void *arg)
 		av_dict_set(&format_opts, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
 		scan_all_pmts_set = 1;
 	}
+	if (read_ahead_window > 0 && is_network_path(is->filename) &&
+		read_ahead_open(&read_ahead, is->filename, &ic->interrupt_callback, &is->mem) == 0) {
+		ic->pb = read_ahead->pb;
+		ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+		SDL_AtomicLock(&is->read_ahead_lock);
+		is->read_ahead = read_ahead;
+		if (is->abort_request)
+			read_ahead_abort(read_ahead);
+		SDL_AtomicUnlock(&is->read_ahead_lock);
+	}
+	else if (mapped_io && mapped_avio_open(&is->mapped_pb, is->filename) == 0) {
+		ic->pb = is->mapped_pb;
+		ic->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
 	err = avformat_open_input(&ic, is->filename, is->iformat, &format_opts);
 	if (err < 0) {
 		print_error(is->filename, err);
@@ -2972,6 +6484,20 @@ static int read_thread(void *arg)
 	if (show_status)
 		av_dump_format(ic, 0, is->filename, 0);
 
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++) {
+		enum AVMediaType type = i == EXTERNAL_AUDIO ? AVMEDIA_TYPE_AUDIO : AVMEDIA_TYPE_SUBTITLE;
+
+		if (!external_urls[i] || (type == AVMEDIA_TYPE_AUDIO ? audio_disable : video_disable || subtitle_disable))
+			continue;
+		if ((err = external_input_open(is, &is->ext[i], type, external_urls[i])) < 0) {
+			print_error(external_urls[i], err);
+			external_input_close(&is->ext[i]);
+			continue;
+		}
+		if (start_time != AV_NOPTS_VALUE)
+			external_input_seek(&is->ext[i], start_time + is->ext[i].ts_offset);
+	}
+
 
 
 	for (i = 0; i < ic->nb_streams; i++) {
@@ -3017,6 +6543,11 @@ static int read_thread(void *arg)
 				st_index[AVMEDIA_TYPE_AUDIO] :
 				st_index[AVMEDIA_TYPE_VIDEO]),
 			NULL, 0);
+	/* external tracks replace the ones of the main input */
+	if (is->ext[EXTERNAL_AUDIO].st)
+		st_index[AVMEDIA_TYPE_AUDIO] = EXTERNAL_STREAM_BASE + EXTERNAL_AUDIO;
+	if (is->ext[EXTERNAL_SUBTITLE].st)
+		st_index[AVMEDIA_TYPE_SUBTITLE] = EXTERNAL_STREAM_BASE + EXTERNAL_SUBTITLE;
 
 	is->show_mode = show_mode;
 	if (st_index[AVMEDIA_TYPE_VIDEO] >= 0) {
@@ -3050,9 +6581,21 @@ static int read_thread(void *arg)
 		goto fail;
 	}
 
+	for (i = 0; i < EXTERNAL_INPUT_NB; i++) {
+		if (is->audio_stream != EXTERNAL_STREAM_BASE + i && is->subtitle_stream != EXTERNAL_STREAM_BASE + i)
+			continue;
+		if (!(is->ext[i].tid = SDL_CreateThread(external_read_thread, "external_read", &is->ext[i])))
+			av_log(NULL, AV_LOG_ERROR, "SDL_CreateThread(): %s\n", SDL_GetError());
+	}
+
 	if (infinite_buffer < 0 && is->realtime)
 		infinite_buffer = 1;
 
+	keyframe_index_open(&is->kf_index, ic,
+		is->video_st && !(is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) ? is->video_st :
+		stream_in_main(is->audio_stream) >= 0 ? is->audio_st : NULL,
+		is->filename);
+
 
 	if (on_success != NULL)
 		on_success();
@@ -3071,24 +6614,133 @@ static int read_thread(void *arg)
 		if (is->paused &&
 			(!strcmp(ic->iformat->name, "rtsp") ||
 			(ic->pb && !strncmp(input_filename, "mmsh:", 5)))) {
-			/* wait 10 ms to avoid trying to get another packet */
-			/* XXX: horrible */
-			SDL_Delay(10);
+			/* no packet can be read until the stream is resumed */
+			read_wake_wait(&is->continue_read_thread, -1);
 			continue;
 		}
 #endif
+		if (is->reverse_req != is->reverse) {
+			if (is->reverse_req) {
+				is->reverse_pos = get_master_clock(is);
+				is->reverse = 1;
+				/* the video decoder drains and video_thread switches over to the reverse player */
+				external_inputs_lock(is);
+				if (is->video_stream >= 0) {
+					packet_queue_flush(&is->videoq);
+					packet_queue_put(&is->videoq, &flush_pkt);
+					packet_queue_put_nullpacket(&is->videoq, is->video_stream);
+				}
+				if (is->audio_stream >= 0) {
+					packet_queue_flush(&is->audioq);
+					packet_queue_put(&is->audioq, &flush_pkt);
+				}
+				if (is->subtitle_stream >= 0) {
+					packet_queue_flush(&is->subtitleq);
+					packet_queue_put(&is->subtitleq, &flush_pkt);
+				}
+				external_inputs_unlock(is);
+				if (is->paused)
+					step_to_next_frame(is);
+			}
+			else {
+				double pos = get_clock(&is->vidclk);
+
+				is->reverse = 0;
+				set_playback_clock_speed(is, is->playback_speed);
+				SDL_LockMutex(is->rev.mutex);
+				SDL_CondBroadcast(is->rev.cond);
+				SDL_UnlockMutex(is->rev.mutex);
+				/* carry on forward from the picture on screen, unless a seek came in meanwhile */
+				stream_seek(is, (int64_t)((isnan(pos) ? is->reverse_pos : pos) * AV_TIME_BASE), 0, 0);
+			}
+		}
+		if (is->speed_req != is->playback_speed) {
+			is->playback_speed = is->speed_req;
+			/* trick play and reverse pick it up when they end */
+			if (!is->trick_rate && !is->reverse)
+				set_playback_clock_speed(is, is->playback_speed);
+		}
+		if (is->reverse) {
+			read_wake_wait(&is->continue_read_thread, -1);
+			continue;
+		}
+		if (is->trick_req != is->trick_rate) {
+			double pos = get_master_clock(is);
+
+			external_inputs_lock(is);
+			if (is->video_stream >= 0) {
+				packet_queue_flush(&is->videoq);
+				packet_queue_put(&is->videoq, &flush_pkt);
+			}
+			if (is->audio_stream >= 0) {
+				packet_queue_flush(&is->audioq);
+				packet_queue_put(&is->audioq, &flush_pkt);
+			}
+			if (is->subtitle_stream >= 0) {
+				packet_queue_flush(&is->subtitleq);
+				packet_queue_put(&is->subtitleq, &flush_pkt);
+			}
+			external_inputs_unlock(is);
+
+			is->trick_rate = is->trick_req;
+			if (is->trick_rate) {
+				is->speed = is->trick_rate;
+				set_clock_speed(&is->vidclk, is->speed);
+			}
+			else
+				set_playback_clock_speed(is, is->playback_speed);
+			if (is->trick_rate) {
+				is->trick_step = (int64_t)FFABS(is->trick_rate) * AV_TIME_BASE / TRICK_PLAY_FPS;
+				is->trick_last = AV_NOPTS_VALUE;
+				is->trick_done = 0;
+				is->trick_seekable = !is->realtime && ic->pb && (ic->pb->seekable & AVIO_SEEKABLE_NORMAL);
+				is->trick_target = isnan(pos) ? 0 : (int64_t)(pos * AV_TIME_BASE);
+				is->trick_seek = !isnan(pos) && (is->trick_rate < 0 || is->trick_seekable);
+			}
+			else if (!isnan(pos)) {
+				/* play on from the last keyframe shown */
+				stream_seek(is, (int64_t)(pos * AV_TIME_BASE), 0, 0);
+			}
+			if (is->paused)
+				step_to_next_frame(is);
+		}
+		if (is->trick_rate && is->trick_done) {
+			read_wake_wait(&is->continue_read_thread, -1);
+			continue;
+		}
+		if (is->trick_rate && is->trick_seek)
+			trick_play_seek(is);
 		if (is->seek_req) {
+			int accurate = accurate_seek && !(is->seek_flags & AVSEEK_FLAG_BYTE);
 			int64_t seek_target = is->seek_pos;
-			int64_t seek_min = is->seek_rel > 0 ? seek_target - is->seek_rel + 2 : INT64_MIN;
-			int64_t seek_max = is->seek_rel < 0 ? seek_target - is->seek_rel - 2 : INT64_MAX;
+			int64_t seek_min = is->seek_rel > 0 && !accurate ? seek_target - is->seek_rel + 2 : INT64_MIN;
+			int64_t seek_max = accurate ? seek_target : is->seek_rel < 0 ? seek_target - is->seek_rel - 2 : INT64_MAX;
 			// FIXME the +-2 is due to rounding being not done in the correct direction in generation
 			//      of the seek_pos/seek_rel variables
-
-			ret = avformat_seek_file(is->ic, -1, seek_min, seek_target, seek_max, is->seek_flags);
-			if (ret < 0) {
+			int buffered;
+
+			/* an accurate seek lands on the keyframe before the target and decodes up to it */
+			if (accurate && is->video_stream >= 0)
+				packet_queue_set_preroll(&is->videoq, seek_target);
+			if (accurate && is->audio_stream >= 0)
+				packet_queue_set_preroll(&is->audioq, seek_target);
+			external_inputs_lock(is);
+			buffered = stream_seek_buffered(is, seek_target);
+
+			is->seek_count++;
+			if (buffered) {
+				is->seek_buffered_count++;
+				set_clock(&is->extclk, seek_target / (double)AV_TIME_BASE, 0);
+				av_log(NULL, AV_LOG_DEBUG, "seek served from buffer (%d/%d)\n",
+					is->seek_buffered_count, is->seek_count);
+			}
+			else if ((ret = stream_seek_demuxer(is, seek_target, seek_min, seek_max)) < 0) {
 				av_log(NULL, AV_LOG_WARNING, "%s: error while seeking\n", is->ic->url);
+				packet_queue_set_preroll(&is->videoq, AV_NOPTS_VALUE);
+				packet_queue_set_preroll(&is->audioq, AV_NOPTS_VALUE);
 			}
 			else {
+				external_inputs_seek(is, seek_target);
 				if (is->audio_stream >= 0) {
 					packet_queue_flush(&is->audioq);
 					packet_queue_put(&is->audioq, &flush_pkt);
@@ -3108,12 +6760,22 @@ static int read_thread(void *arg)
 					set_clock(&is->extclk, seek_target / (double)AV_TIME_BASE, 0);
 				}
 			}
+			external_inputs_unlock(is);
+			/* trick play goes on from the new position */
+			is->trick_last = AV_NOPTS_VALUE;
+			is->trick_done = 0;
+			is->trick_seek = 0;
+			is->seek_display_serial = is->videoq.serial;
 			is->seek_req = 0;
-			is->queue_attachments_req = 1;
-			is->eof = 0;
+			if (!buffered) {
+				/* the demuxer position is untouched by a buffered seek */
+				is->queue_attachments_req = 1;
+				is->eof = 0;
+			}
 			if (is->paused)
 				step_to_next_frame(is);
 		}
+		update_memory_budget(is);
 		if (is->queue_attachments_req) {
 			if (is->video_st && is->video_st->disposition & AV_DISPOSITION_ATTACHED_PIC) {
 				AVPacket copy = { 0 };
@@ -3126,16 +6788,23 @@ static int read_thread(void *arg)
 		}
 
 		/* if the queue are full, no need to read more */
-		if (infinite_buffer < 1 &&
-			(is->audioq.size + is->videoq.size + is->subtitleq.size > MAX_QUEUE_SIZE
-				|| (stream_has_enough_packets(is->audio_st, is->audio_stream, &is->audioq) &&
-					stream_has_enough_packets(is->video_st, is->video_stream, &is->videoq) &&
-					stream_has_enough_packets(is->subtitle_st, is->subtitle_stream, &is->subtitleq)))) {
-			/* wait 10 ms */
-			SDL_LockMutex(wait_mutex);
-			SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
-			SDL_UnlockMutex(wait_mutex);
-			continue;
+		if (infinite_buffer < 1) {
+			/* queues fed by an external input are its reader's business */
+			int audio_stream = is->trick_rate ? -1 : stream_in_main(is->audio_stream);
+			int subtitle_stream = is->trick_rate ? -1 : stream_in_main(is->subtitle_stream);
+			int short_read_ahead = is->mem.shed_level >= MEM_SHED_READ_AHEAD;
+			int wants_audio = stream_wants_packets(is->audio_st, audio_stream, &is->audioq, short_read_ahead);
+			int wants_video = stream_wants_packets(is->video_st, is->video_stream, &is->videoq, short_read_ahead);
+			int wants_subtitle = stream_wants_packets(is->subtitle_st, subtitle_stream, &is->subtitleq, short_read_ahead);
+
+			/* a full subtitle queue sheds packets below instead, a sparse stream never holds the reader */
+			if (stream_over_limit(audio_stream, &is->audioq) ||
+				stream_over_limit(is->video_stream, &is->videoq) ||
+				(!wants_audio && !wants_video && !wants_subtitle)) {
+				/* sleep until a decoder drains its queue below the low watermark */
+				read_wake_wait(&is->continue_read_thread, -1);
+				continue;
+			}
 		}
 		if (!is->paused &&
 			(!is->audio_st || (is->auddec.finished == is->audioq.serial && frame_queue_nb_remaining(&is->sampq) == 0)) &&
@@ -3153,9 +6822,9 @@ static int read_thread(void *arg)
 			if ((ret == AVERROR_EOF || avio_feof(ic->pb)) && !is->eof) {
 				if (is->video_stream >= 0)
 					packet_queue_put_nullpacket(&is->videoq, is->video_stream);
-				if (is->audio_stream >= 0)
+				if (stream_in_main(is->audio_stream) >= 0)
 					packet_queue_put_nullpacket(&is->audioq, is->audio_stream);
-				if (is->subtitle_stream >= 0)
+				if (stream_in_main(is->subtitle_stream) >= 0)
 					packet_queue_put_nullpacket(&is->subtitleq, is->subtitle_stream);
 				is->eof = 1;
 				if (on_complete != NULL)
@@ -3163,16 +6832,26 @@ static int read_thread(void *arg)
 			}
 			if (ic->pb && ic->pb->error)
 				break;
-			SDL_LockMutex(wait_mutex);
-			SDL_CondWaitTimeout(is->continue_read_thread, wait_mutex, 10);
-			SDL_UnlockMutex(wait_mutex);
-
-
+			/* polling is only needed to retry a failed read or to notice the end of playback for loop and autoexit */
+			if (is->paused || (is->eof && loop == 1 && !autoexit))
+				read_wake_wait(&is->continue_read_thread, -1);
+			else
+				read_wake_wait(&is->continue_read_thread, READ_THREAD_RETRY_WAIT);
 			continue;
 		}
 		else {
 			is->eof = 0;
 		}
+		if (pkt->stream_index == is->kf_index.stream_index && (pkt->flags & AV_PKT_FLAG_KEY) &&
+			pkt->pts != AV_NOPTS_VALUE && pkt->pos >= 0 && !is->kf_index.complete) {
+			SDL_LockMutex(is->kf_index.mutex);
+			keyframe_index_add(&is->kf_index, pkt->pts, pkt->pos);
+			SDL_UnlockMutex(is->kf_index.mutex);
+		}
+		if (is->trick_rate && !trick_play_wants(is, pkt)) {
+			av_packet_unref(pkt);
+			continue;
+		}
 		/* check if packet is in play range specified by user, then queue, otherwise discard */
 		stream_start_time = ic->streams[pkt->stream_index]->start_time;
 		pkt_ts = pkt->pts == AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
@@ -3189,7 +6868,13 @@ static int read_thread(void *arg)
 			packet_queue_put(&is->videoq, pkt);
 		}
 		else if (pkt->stream_index == is->subtitle_stream && pkt_in_play_range) {
-			packet_queue_put(&is->subtitleq, pkt);
+			if (stream_over_limit(is->subtitle_stream, &is->subtitleq)) {
+				av_log(NULL, AV_LOG_WARNING, "Subtitle queue full, dropping a subtitle packet\n");
+				av_packet_unref(pkt);
+			}
+			else {
+				packet_queue_put(&is->subtitleq, pkt);
+			}
 		}
 		else {
 			av_packet_unref(pkt);
@@ -3200,6 +6885,14 @@ static int read_thread(void *arg)
 fail:
 	if (ic && !is->ic)
 		avformat_close_input(&ic);
+	if (!is->ic) {
+		mapped_avio_close(&is->mapped_pb);
+		SDL_AtomicLock(&is->read_ahead_lock);
+		read_ahead = is->read_ahead;
+		is->read_ahead = NULL;
+		SDL_AtomicUnlock(&is->read_ahead_lock);
+		read_ahead_close(&read_ahead);
+	}
 
 	if (ret != 0) {
 		SDL_Event event;
@@ -3208,7 +6901,6 @@ fail:
 		event.user.data1 = is;
 		SDL_PushEvent(&event);
 	}
-	SDL_DestroyMutex(wait_mutex);
 	return 0;
 }
 
@@ -3226,20 +6918,28 @@ static VideoState *stream_open(const char *filename, AVInputFormat *iformat)
 	is->ytop = 0;
 	is->xleft = 0;
 
+	is->mem.limit = memory_budget;
+	is->kf_index.stream_index = -1;
+	mem_account(&is->mem, MEM_VISUALIZER, sizeof(is->sample_array));
+
 	/* start video display */
-	if (frame_queue_init(&is->pictq, &is->videoq, VIDEO_PICTURE_QUEUE_SIZE, 1) < 0)
+	if (frame_queue_init(&is->pictq, &is->videoq, picture_queue_min, picture_queue_max, 1, &is->mem) < 0)
 		goto fail;
-	if (frame_queue_init(&is->subpq, &is->subtitleq, SUBPICTURE_QUEUE_SIZE, 0) < 0)
+	if (frame_queue_init(&is->subpq, &is->subtitleq, SUBPICTURE_QUEUE_SIZE, SUBPICTURE_QUEUE_SIZE, 0, &is->mem) < 0)
 		goto fail;
-	if (frame_queue_init(&is->sampq, &is->audioq, SAMPLE_QUEUE_SIZE, 1) < 0)
+	if (frame_queue_init(&is->sampq, &is->audioq, sample_queue_size, sample_queue_size, 1, &is->mem) < 0)
 		goto fail;
 
-	if (packet_queue_init(&is->videoq) < 0 ||
-		packet_queue_init(&is->audioq) < 0 ||
-		packet_queue_init(&is->subtitleq) < 0)
+	if (packet_queue_init(&is->videoq, PACKET_QUEUE_SIZE, &buffer_watermarks[0], &retention_windows[0], &is->mem) < 0 ||
+		packet_queue_init(&is->audioq, PACKET_QUEUE_SIZE, &buffer_watermarks[1], &retention_windows[1], &is->mem) < 0 ||
+		packet_queue_init(&is->subtitleq, SUBTITLE_PACKET_QUEUE_SIZE, &buffer_watermarks[2], &retention_windows[2], &is->mem) < 0)
 		goto fail;
 
-	if (!(is->continue_read_thread = SDL_CreateCond())) {
+	if (read_wake_init(&is->continue_read_thread) < 0) {
+		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
+		goto fail;
+	}
+	if (!(is->rev.mutex = SDL_CreateMutex()) || !(is->rev.cond = SDL_CreateCond())) {
 		av_log(NULL, AV_LOG_FATAL, "SDL_CreateCond(): %s\n", SDL_GetError());
 		goto fail;
 	}
@@ -3247,6 +6947,12 @@ static VideoState *stream_open(const char *filename, AVInputFormat *iformat)
 	init_clock(&is->vidclk, &is->videoq.serial);
 	init_clock(&is->audclk, &is->audioq.serial);
 	init_clock(&is->extclk, &is->extclk.serial);
+	is->speed = is->playback_speed = is->speed_req = 1.0;
+	is->speed_last_pts = NAN;
+	is->speed_last_serial = -1;
+#if CONFIG_AVFILTER
+	is->audio_tempo_speed = 1.0;
+#endif
 
 
 	is->audio_clock_serial = -1;
@@ -3290,6 +6996,9 @@ static void stream_cycle_channel(VideoState *is, int codec_type)
 		start_index = is->last_subtitle_stream;
 		old_index = is->subtitle_stream;
 	}
+	/* cycling leaves an external track for the streams of the main input */
+	if (start_index >= EXTERNAL_STREAM_BASE)
+		start_index = -1;
 	stream_index = start_index;
 
 	if (codec_type != AVMEDIA_TYPE_VIDEO && is->video_stream != -1) {
@@ -3604,10 +7313,7 @@ static void old_event_loop(VideoState *cur_stream)
 
 				screen_width = cur_stream->width = event.window.data1;
 				screen_height = cur_stream->height = event.window.data2;
-				if (cur_stream->vis_texture) {
-					SDL_DestroyTexture(cur_stream->vis_texture);
-					cur_stream->vis_texture = NULL;
-				}
+				destroy_texture(&cur_stream->mem, &cur_stream->vis_texture);
 			case SDL_WINDOWEVENT_EXPOSED:
 				cur_stream->force_refresh = 1;
 			}
@@ -3952,24 +7658,238 @@ static int event_loop_thread(void * ssss) {
 		}
 	}
 
-	//SDL_CreateThread(start_stream, "event_loop_thread", NULL);
+	//SDL_CreateThread(start_stream, "event_loop_thread", NULL);
+
+
+	VideoState * is = stream_open(input_filename, file_iformat);
+	if (!is) {
+		av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
+		do_exit(NULL);
+		return 2;
+	}
+	cur_video = is;
+
+	if (is_stoped > 0) {
+		do_exit(cur_video);
+		return;
+	}
+
+	old_event_loop(is);
+	//event_loop(is);
+}
+
+static int thumbnail_worker_open(ThumbnailWorker *w)
+{
+	ThumbnailBatch *tb = w->tb;
+	AVDictionary *opts = NULL;
+	int ret;
+
+	if (!(w->frame = av_frame_alloc()) || !(w->avctx = avcodec_alloc_context3(NULL)))
+		return AVERROR(ENOMEM);
+	if ((ret = avcodec_parameters_to_context(w->avctx, tb->st->codecpar)) < 0)
+		return ret;
+	w->avctx->pkt_timebase = tb->st->time_base;
+	w->avctx->lowres = tb->lowres;
+	w->avctx->skip_frame = AVDISCARD_NONKEY;
+	/* the batch runs in parallel across pictures already */
+	av_dict_set(&opts, "threads", "1", 0);
+	av_dict_set(&opts, "refcounted_frames", "1", 0);
+	ret = avcodec_open2(w->avctx, tb->codec, &opts);
+	av_dict_free(&opts);
+	return ret;
+}
+
+static void thumbnail_worker_close(ThumbnailWorker *w)
+{
+	if (w->tid)
+		SDL_WaitThread(w->tid, NULL);
+	avcodec_free_context(&w->avctx);
+	av_frame_free(&w->frame);
+	sws_freeContext(w->sws);
+	memset(w, 0, sizeof(*w));
+}
+
+static int thumbnail_decode(ThumbnailWorker *w, ThumbnailJob *job, unsigned char *out)
+{
+	ThumbnailBatch *tb = w->tb;
+	uint8_t *dst[4] = { out };
+	int dst_linesize[4] = { tb->width * 4 };
+	int ret;
+
+	if ((ret = avcodec_send_packet(w->avctx, &job->pkt)) >= 0) {
+		ret = avcodec_receive_frame(w->avctx, w->frame);
+		if (ret == AVERROR(EAGAIN)) {
+			/* decoders with a delay give the picture up on drain */
+			avcodec_send_packet(w->avctx, NULL);
+			ret = avcodec_receive_frame(w->avctx, w->frame);
+		}
+	}
+	avcodec_flush_buffers(w->avctx);
+	if (ret < 0)
+		return ret;
+
+	w->sws = sws_getCachedContext(w->sws, w->frame->width, w->frame->height, w->frame->format,
+		tb->width, tb->height, AV_PIX_FMT_RGBA, SWS_BILINEAR, NULL, NULL, NULL);
+	if (w->sws)
+		sws_scale(w->sws, (const uint8_t * const *)w->frame->data, w->frame->linesize, 0, w->frame->height, dst, dst_linesize);
+	else
+		ret = AVERROR(EINVAL);
+	av_frame_unref(w->frame);
+	return ret;
+}
+
+static int thumbnail_thread(void *arg)
+{
+	ThumbnailWorker *w = arg;
+	ThumbnailBatch *tb = w->tb;
+	ThumbnailJob *job;
+
+	for (;;) {
+		SDL_LockMutex(tb->mutex);
+		while (tb->next >= tb->nb_read && tb->nb_read < tb->nb_jobs)
+			SDL_CondWait(tb->cond, tb->mutex);
+		if (tb->next >= tb->nb_jobs) {
+			SDL_UnlockMutex(tb->mutex);
+			break;
+		}
+		job = tb->order[tb->next++];
+		SDL_UnlockMutex(tb->mutex);
+
+		if (job->ready && job->dup < 0)
+			job->done = thumbnail_decode(w, job, tb->out[job - tb->jobs]) >= 0;
+	}
+	return 0;
+}
+
+/* seek to the keyframe at or before the job time, the first one after it if there is none */
+static int thumbnail_read_keyframe(AVFormatContext *ic, AVStream *st, ThumbnailJob *job)
+{
+	int64_t ts = av_rescale_q(job->ts, AV_TIME_BASE_Q, st->time_base);
+	int i, ret;
+
+	if (st->start_time != AV_NOPTS_VALUE)
+		ts += st->start_time;
+	if ((ret = avformat_seek_file(ic, st->index, INT64_MIN, ts, ts, 0)) < 0 &&
+		(ret = avformat_seek_file(ic, st->index, INT64_MIN, ts, INT64_MAX, 0)) < 0)
+		return ret;
+	for (i = 0; i < THUMBNAIL_MAX_READS; i++) {
+		if ((ret = av_read_frame(ic, &job->pkt)) < 0)
+			return ret;
+		if (job->pkt.stream_index == st->index && (job->pkt.flags & AV_PKT_FLAG_KEY))
+			return 0;
+		av_packet_unref(&job->pkt);
+	}
+	return AVERROR_INVALIDDATA;
+}
 
+static int thumbnail_cmp(const void *a, const void *b)
+{
+	int64_t ta = (*(ThumbnailJob * const *)a)->ts, tb = (*(ThumbnailJob * const *)b)->ts;
 
-	VideoState * is = stream_open(input_filename, file_iformat);
-	if (!is) {
-		av_log(NULL, AV_LOG_FATAL, "Failed to initialize VideoState!\n");
-		do_exit(NULL);
-		return 2;
+	return ta < tb ? -1 : ta > tb;
+}
+
+static int thumbnails(const char *url, const long long *timestamps, int n, int width, int height, unsigned char **out)
+{
+	ThumbnailBatch tb = { 0 };
+	ThumbnailWorker workers[THUMBNAIL_MAX_WORKERS] = { 0 };
+	AVFormatContext *ic = NULL;
+	AVCodecParameters *par;
+	int64_t start = av_gettime_relative();
+	int nb_workers = 0, nb_done = 0;
+	int i, k, ret, prev = -1;
+
+	if ((ret = avformat_open_input(&ic, url, NULL, NULL)) < 0)
+		return ret;
+	if ((ret = avformat_find_stream_info(ic, NULL)) < 0)
+		goto end;
+	if ((ret = av_find_best_stream(ic, AVMEDIA_TYPE_VIDEO, -1, -1, &tb.codec, 0)) < 0)
+		goto end;
+	tb.st = ic->streams[ret];
+	for (i = 0; i < ic->nb_streams; i++)
+		ic->streams[i]->discard = i == tb.st->index ? AVDISCARD_DEFAULT : AVDISCARD_ALL;
+	par = tb.st->codecpar;
+	/* the smallest picture the decoder can give that still covers the thumbnail */
+	while (tb.lowres < tb.codec->max_lowres &&
+		AV_CEIL_RSHIFT(par->width, tb.lowres + 1) >= width && AV_CEIL_RSHIFT(par->height, tb.lowres + 1) >= height)
+		tb.lowres++;
+
+	tb.width = width;
+	tb.height = height;
+	tb.out = out;
+	tb.nb_jobs = n;
+	if (!(tb.jobs = av_mallocz_array(n, sizeof(*tb.jobs))) || !(tb.order = av_malloc_array(n, sizeof(*tb.order))) ||
+		!(tb.mutex = SDL_CreateMutex()) || !(tb.cond = SDL_CreateCond())) {
+		ret = AVERROR(ENOMEM);
+		goto end;
 	}
-	cur_video = is;
+	for (i = 0; i < n; i++) {
+		tb.jobs[i].ts = av_rescale(timestamps[i], AV_TIME_BASE, 1000);
+		tb.jobs[i].dup = -1;
+		tb.order[i] = &tb.jobs[i];
+	}
+	/* seek forward only */
+	qsort(tb.order, n, sizeof(*tb.order), thumbnail_cmp);
 
-	if (is_stoped > 0) {
-		do_exit(cur_video);
-		return;
+	for (i = 0; i < FFMIN(FFMIN(SDL_GetCPUCount(), THUMBNAIL_MAX_WORKERS), n); i++) {
+		workers[i].tb = &tb;
+		if ((ret = thumbnail_worker_open(&workers[i])) < 0 ||
+			!(workers[i].tid = SDL_CreateThread(thumbnail_thread, "thumbnail", &workers[i]))) {
+			thumbnail_worker_close(&workers[i]);
+			break;
+		}
+		nb_workers++;
+	}
+	if (!nb_workers) {
+		ret = ret < 0 ? ret : AVERROR(ENOMEM);
+		goto end;
 	}
 
-	old_event_loop(is);
-	//event_loop(is);
+	for (k = 0; k < n; k++) {
+		ThumbnailJob *job = tb.order[k];
+
+		if (thumbnail_read_keyframe(ic, tb.st, job) >= 0) {
+			job->ready = 1;
+			/* without a timestamp and a file position two keyframes cannot be told apart */
+			if (prev >= 0 && job->pkt.pts != AV_NOPTS_VALUE && job->pkt.pos >= 0 &&
+				tb.jobs[prev].pkt.pts == job->pkt.pts && tb.jobs[prev].pkt.pos == job->pkt.pos)
+				job->dup = tb.jobs[prev].dup >= 0 ? tb.jobs[prev].dup : prev;
+			prev = job - tb.jobs;
+		}
+		SDL_LockMutex(tb.mutex);
+		tb.nb_read++;
+		SDL_CondBroadcast(tb.cond);
+		SDL_UnlockMutex(tb.mutex);
+	}
+	for (i = 0; i < nb_workers; i++)
+		thumbnail_worker_close(&workers[i]);
+
+	for (i = 0; i < n; i++) {
+		ThumbnailJob *job = &tb.jobs[i];
+		if (job->dup >= 0 && tb.jobs[job->dup].done) {
+			memcpy(out[i], out[job->dup], (size_t)width * height * 4);
+			job->done = 1;
+		}
+		if (job->done)
+			nb_done++;
+		else
+			memset(out[i], 0, (size_t)width * height * 4);
+	}
+	thumbnail_rate = nb_done / FFMAX((av_gettime_relative() - start) / 1000000.0, 1e-6);
+	av_log(NULL, AV_LOG_VERBOSE, "%d of %d thumbnails from %d workers, %.1f per second\n",
+		nb_done, n, nb_workers, thumbnail_rate);
+	ret = nb_done;
+
+end:
+	if (tb.jobs)
+		for (i = 0; i < n; i++)
+			av_packet_unref(&tb.jobs[i].pkt);
+	av_free(tb.jobs);
+	av_free(tb.order);
+	SDL_DestroyCond(tb.cond);
+	SDL_DestroyMutex(tb.mutex);
+	avformat_close_input(&ic);
+	return ret;
 }
 
 EXPORT_API int WINAPI ffplay_set_vf(const char * cmd)
@@ -4056,10 +7976,7 @@ EXPORT_API int WINAPI ffplay_resize(int w, int h)
 	//SDL_SetWindowSize(window, w, h);
 	screen_width = cur_video->width = w;
 	screen_height = cur_video->height = h;
-	if (cur_video->vis_texture) {
-		SDL_DestroyTexture(cur_video->vis_texture);
-		cur_video->vis_texture = NULL;
-	}
+	destroy_texture(&cur_video->mem, &cur_video->vis_texture);
 	return 0;
 }
 
@@ -4103,6 +8020,11 @@ EXPORT_API void WINAPI ffplay_on_complete(void(*on_comp)())
 	on_complete = on_comp;
 }
 
+EXPORT_API void WINAPI ffplay_on_decode_quality(void(*func)(int level, int load))
+{
+	on_decode_quality = func;
+}
+
 EXPORT_API int WINAPI ffplay_get_state()
 {
 	int ret = 0;
@@ -4215,4 +8137,373 @@ EXPORT_API int WINAPI ffplay_set_position(long long position)
 
 	stream_seek(cur_video, (int64_t)(position * TIME_MILL), (int64_t)(incr * TIME_MILL), 0);
 
-}
\ No newline at end of file
+}
+
+/* packet queue of an API stream number: 0 video, 1 audio, 2 subtitle */
+static PacketQueue *stream_table_queue(VideoState *is, int stream)
+{
+	return stream == 0 ? &is->videoq : stream == 1 ? &is->audioq : &is->subtitleq;
+}
+
+EXPORT_API int WINAPI ffplay_set_buffer_watermarks(int stream, double low_seconds, double high_seconds, int low_bytes, int high_bytes)
+{
+	PacketQueue *q;
+
+	if (!TABLE_INDEX_VALID(buffer_watermarks, stream))
+		return -1;
+	if (low_seconds < 0 || low_seconds > high_seconds || low_bytes < 0 || low_bytes > high_bytes || high_bytes <= 0)
+		return -1;
+
+	buffer_watermarks[stream].low_seconds = low_seconds;
+	buffer_watermarks[stream].high_seconds = high_seconds;
+	buffer_watermarks[stream].low_bytes = low_bytes;
+	buffer_watermarks[stream].high_bytes = high_bytes;
+
+	if (cur_video == NULL)
+		return 0;
+
+	q = stream_table_queue(cur_video, stream);
+	q->wm = buffer_watermarks[stream];
+	read_wake_signal(&cur_video->continue_read_thread);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_frame_queue_size(int picture_min, int picture_max, int samples)
+{
+	if (picture_min < 2 || picture_min > picture_max || samples < 2)
+		return -1;
+
+	picture_queue_min = picture_min;
+	picture_queue_max = picture_max;
+	sample_queue_size = samples;
+	return 0;
+}
+
+EXPORT_API long long WINAPI ffplay_get_frame_queue_bytes()
+{
+	if (cur_video == NULL)
+		return 0;
+
+	return frame_queue_mem_bytes(&cur_video->pictq) +
+		frame_queue_mem_bytes(&cur_video->subpq) +
+		frame_queue_mem_bytes(&cur_video->sampq);
+}
+
+EXPORT_API int WINAPI ffplay_get_seek_stats(int *seeks, int *buffered_seeks)
+{
+	if (cur_video == NULL)
+		return -1;
+
+	if (seeks)
+		*seeks = cur_video->seek_count;
+	if (buffered_seeks)
+		*buffered_seeks = cur_video->seek_buffered_count;
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_retention_window(int stream, double seconds, int bytes)
+{
+	if (!TABLE_INDEX_VALID(retention_windows, stream))
+		return -1;
+	if (seconds < 0 || bytes < 0)
+		return -1;
+
+	retention_windows[stream].seconds = seconds;
+	retention_windows[stream].bytes = bytes;
+
+	if (cur_video == NULL)
+		return 0;
+
+	/* the decoder trims the window to the new limits with the next packet */
+	stream_table_queue(cur_video, stream)->retain = retention_windows[stream];
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_memory_budget(long long bytes)
+{
+	if (bytes < 0)
+		return -1;
+
+	memory_budget = bytes;
+	if (cur_video != NULL) {
+		cur_video->mem.limit = bytes;
+		read_wake_signal(&cur_video->continue_read_thread);
+	}
+	return 0;
+}
+
+EXPORT_API long long WINAPI ffplay_get_memory_usage(int category)
+{
+	if (category >= MEM_NB)
+		return -1;
+	if (cur_video == NULL)
+		return 0;
+
+	return mem_used(&cur_video->mem, category);
+}
+
+EXPORT_API int WINAPI ffplay_set_read_ahead(int window_bytes, int threads)
+{
+	if (window_bytes < 0 || threads < 1 || threads > READ_AHEAD_MAX_THREADS)
+		return -1;
+
+	read_ahead_window = window_bytes;
+	read_ahead_threads = threads;
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_get_io_latency_histogram(long long *counts, int nb_counts)
+{
+	ReadAhead *ra;
+	int i;
+
+	if (cur_video == NULL || counts == NULL)
+		return 0;
+
+	SDL_AtomicLock(&cur_video->read_ahead_lock);
+	if (!(ra = cur_video->read_ahead)) {
+		SDL_AtomicUnlock(&cur_video->read_ahead_lock);
+		return 0;
+	}
+	nb_counts = FFMIN(nb_counts, IO_LATENCY_BUCKETS);
+	SDL_LockMutex(ra->mutex);
+	for (i = 0; i < nb_counts; i++)
+		counts[i] = ra->latency_hist[i];
+	SDL_UnlockMutex(ra->mutex);
+	SDL_AtomicUnlock(&cur_video->read_ahead_lock);
+	return nb_counts;
+}
+
+EXPORT_API int WINAPI ffplay_get_io_buffer_pool_stats(long long *hits, long long *misses, long long *peak_bytes)
+{
+	IoBufferPool *ip = &io_buffer_pool;
+
+	if (io_buffer_pool_init(ip) < 0)
+		return -1;
+
+	SDL_LockMutex(ip->mutex);
+	if (hits)
+		*hits = ip->requests - ip->misses;
+	if (misses)
+		*misses = ip->misses;
+	if (peak_bytes)
+		*peak_bytes = (long long)ip->peak_allocated * READ_AHEAD_CHUNK;
+	SDL_UnlockMutex(ip->mutex);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_index_cache_dir(const char *dir)
+{
+	av_freep(&index_cache_dir);
+	if (dir && !(index_cache_dir = av_strdup(dir)))
+		return -1;
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_build_keyframe_index()
+{
+	if (cur_video == NULL)
+		return -1;
+
+	return keyframe_index_build(&cur_video->kf_index);
+}
+
+EXPORT_API void WINAPI ffplay_set_accurate_seek(int val)
+{
+	accurate_seek = val;
+}
+
+EXPORT_API double WINAPI ffplay_get_seek_latency()
+{
+	if (cur_video == NULL || cur_video->seek_request_time || !cur_video->seek_count)
+		return -1;
+
+	return cur_video->seek_latency * 1000;
+}
+
+EXPORT_API int WINAPI ffplay_get_read_wakeups()
+{
+	if (cur_video == NULL)
+		return -1;
+
+	return cur_video->continue_read_thread.wakeups;
+}
+
+EXPORT_API int WINAPI ffplay_set_external_input(int stream, const char *url)
+{
+	int i;
+
+	if (stream == 1)
+		i = EXTERNAL_AUDIO;
+	else if (stream == 2)
+		i = EXTERNAL_SUBTITLE;
+	else
+		return -1;
+
+	av_freep(&external_urls[i]);
+	if (url && *url && !(external_urls[i] = av_strdup(url)))
+		return -1;
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_decode_scheduler(int decode_steps, int codec_threads)
+{
+	if (decode_steps < 0 || codec_threads < 0)
+		return -1;
+
+	/* shared by every player of the process; codec threads apply to decoders opened later */
+	decode_scheduler.codec_threads = codec_threads;
+	if (decode_scheduler_init(&decode_scheduler) < 0) {
+		decode_scheduler.capacity = decode_steps;
+		return -1;
+	}
+	SDL_LockMutex(decode_scheduler.mutex);
+	decode_scheduler.capacity = decode_steps;
+	SDL_CondBroadcast(decode_scheduler.cond);
+	SDL_UnlockMutex(decode_scheduler.mutex);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_decode_quality_max(int level)
+{
+	if (!TABLE_INDEX_VALID(decode_quality_levels, level))
+		return -1;
+
+	/* the video thread applies a lower cap with its next quality check */
+	decode_quality_max = level;
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_get_decode_quality()
+{
+	if (cur_video == NULL || !cur_video->video_st)
+		return -1;
+
+	return cur_video->viddec.quality;
+}
+
+EXPORT_API int WINAPI ffplay_set_reverse(int val)
+{
+	if (cur_video == NULL || !cur_video->video_st || cur_video->trick_req)
+		return -1;
+#if CONFIG_AVFILTER
+	/* reversed pictures do not go through the filter graph, the -vf would be dropped silently */
+	if (val && nb_vfilters > 0)
+		return -1;
+#endif
+
+	cur_video->reverse_req = !!val;
+	read_wake_signal(&cur_video->continue_read_thread);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_trick_play(int rate)
+{
+	if (rate && (FFABS(rate) < 2 || FFABS(rate) > TRICK_PLAY_MAX_RATE))
+		return -1;
+	if (cur_video == NULL || !cur_video->video_st || cur_video->reverse_req)
+		return -1;
+
+	cur_video->trick_req = rate;
+	read_wake_signal(&cur_video->continue_read_thread);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_speed(double speed)
+{
+	if (!(speed >= PLAYBACK_SPEED_MIN && speed <= PLAYBACK_SPEED_MAX))
+		return -1;
+	if (cur_video == NULL)
+		return -1;
+
+	cur_video->speed_req = speed;
+	read_wake_signal(&cur_video->continue_read_thread);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_set_codec_pool(int size)
+{
+	if (size < 0 || size > CODEC_POOL_MAX)
+		return -1;
+	if (codec_pool_init(&codec_pool) < 0)
+		return -1;
+
+	SDL_LockMutex(codec_pool.mutex);
+	codec_pool.size = size;
+	codec_pool_trim(&codec_pool, size);
+	SDL_CondSignal(codec_pool.cond);
+	SDL_UnlockMutex(codec_pool.mutex);
+	return 0;
+}
+
+EXPORT_API int WINAPI ffplay_get_codec_pool_hits()
+{
+	int hits = 0;
+
+	if (codec_pool_init(&codec_pool) < 0)
+		return -1;
+	SDL_LockMutex(codec_pool.mutex);
+	hits = codec_pool.hits;
+	SDL_UnlockMutex(codec_pool.mutex);
+	return hits;
+}
+
+EXPORT_API int WINAPI ffplay_thumbnails(const char *path, const long long *timestamps, int n, int width, int height, unsigned char **out_buffers)
+{
+	int ret;
+
+	if (!path || !timestamps || !out_buffers || n <= 0 || width <= 0 || height <= 0)
+		return -1;
+
+	ret = thumbnails(path, timestamps, n, width, height, out_buffers);
+	return ret < 0 ? -1 : ret;
+}
+
+EXPORT_API double WINAPI ffplay_get_thumbnail_rate()
+{
+	return thumbnail_rate;
+}
+
+EXPORT_API void WINAPI ffplay_on_video_frame(void(*func)(FFPlayVideoFrame *frame, void *user), void *user)
+{
+	SDL_AtomicLock(&on_video_frame_lock);
+	on_video_frame_user = user;
+	on_video_frame = func;
+	SDL_AtomicUnlock(&on_video_frame_lock);
+}
+
+EXPORT_API void WINAPI ffplay_release_video_frame(FFPlayVideoFrame *frame)
+{
+	VideoFrameRef *ref = (VideoFrameRef *)frame;
+
+	video_frame_release(&ref);
+}
+
+EXPORT_API int WINAPI ffplay_get_upload_time(int format, double *avg_ms, double *max_ms)
+{
+	UploadStats *us;
+
+	if (cur_video == NULL || format < 0 || format >= AV_PIX_FMT_NB)
+		return -1;
+
+	us = &cur_video->upload_stats[format];
+	if (avg_ms)
+		*avg_ms = us->count ? us->total / 1000.0 / us->count : 0;
+	if (max_ms)
+		*max_ms = us->max / 1000.0;
+	return us->count;
+}
+
+EXPORT_API int WINAPI ffplay_get_render_timings(double *upload_ms, double *present_ms, int *preloaded)
+{
+	if (cur_video == NULL)
+		return -1;
+
+	if (upload_ms)
+		*upload_ms = cur_video->nb_uploads ? cur_video->upload_time / 1000.0 / cur_video->nb_uploads : 0;
+	if (present_ms)
+		*present_ms = cur_video->nb_presents ? cur_video->present_time / 1000.0 / cur_video->nb_presents : 0;
+	if (preloaded)
+		*preloaded = cur_video->nb_preloaded;
+	return cur_video->nb_presents;
+}
@@ -2,6 +2,15 @@
 
 #include "stdafx.h"
 
+//a decoded picture shared with the player, valid until ffplay_release_video_frame
+typedef struct FFPlayVideoFrame {
+	unsigned char *data[4];
+	int linesize[4];
+	int width;
+	int height;
+	int format;              //AVPixelFormat
+	long long pts;           //millisecond, -1 if unknown
+} FFPlayVideoFrame;
 
 // set -vf 
 EXPORT_API int WINAPI ffplay_set_vf(const char * cmd);
@@ -36,6 +45,16 @@ EXPORT_API void WINAPI ffplay_on_complete(void(*on_complete)());
 
 EXPORT_API void WINAPI ffplay_on_error(void(*on_e)(const char * err));
 
+//decode quality step changed (0 full quality), with the video decoder load in percent; called from the decoder thread
+EXPORT_API void WINAPI ffplay_on_decode_quality(void(*func)(int level, int load));
+
+//each picture as it goes on screen, called from the display thread without copying the picture;
+//every frame must be given back with ffplay_release_video_frame, from any thread.
+//ffplay_set_stop_show(1) leaves the rendering out
+EXPORT_API void WINAPI ffplay_on_video_frame(void(*func)(FFPlayVideoFrame *frame, void *user), void *user);
+
+EXPORT_API void WINAPI ffplay_release_video_frame(FFPlayVideoFrame *frame);
+
 // 0.stop 1.playing -1.pause
 EXPORT_API int WINAPI ffplay_get_state();
 
@@ -49,3 +68,103 @@ EXPORT_API long long WINAPI ffplay_get_position();
 
 //millisecond
 EXPORT_API int WINAPI ffplay_set_position(long long position);
+
+//stream: 0.video 1.audio 2.subtitle
+//reading pauses once the queued packets of a stream reach high_seconds or high_bytes,
+//and resumes when they drop below both low_seconds and low_bytes
+EXPORT_API int WINAPI ffplay_set_buffer_watermarks(int stream, double low_seconds, double high_seconds, int low_bytes, int high_bytes);
+
+//number of decoded frames kept ahead of display, applied to the next opened file
+//the picture queue moves between picture_min and picture_max with the decoding jitter
+EXPORT_API int WINAPI ffplay_set_frame_queue_size(int picture_min, int picture_max, int samples);
+
+//bytes of decoded pictures, subtitles and audio currently queued
+EXPORT_API long long WINAPI ffplay_get_frame_queue_bytes();
+
+//seeks since the file was opened, and how many of them were served from the queued packets
+EXPORT_API int WINAPI ffplay_get_seek_stats(int *seeks, int *buffered_seeks);
+
+//stream: 0.video 1.audio 2.subtitle
+//keep up to seconds / bytes of already decoded packets so backward seeks replay from memory,
+//0 for both disables it; video and audio both need a window to rewind
+EXPORT_API int WINAPI ffplay_set_retention_window(int stream, double seconds, int bytes);
+
+//bytes for the whole player, 0 for no limit
+//over the budget the player gives up, in this order: the retention windows,
+//the extra picture queue slots, the read-ahead: packets above the low watermarks and all but
+//threads + 1 read-ahead chunks, which go back to the shared buffer pool
+EXPORT_API int WINAPI ffplay_set_memory_budget(long long bytes);
+
+//category: -1.total 0.queued packets 1.retained packets 2.decoded frames 3.audio visualizer 4.textures 5.read-ahead
+EXPORT_API long long WINAPI ffplay_get_memory_usage(int category);
+
+//files on network shares are read ahead of the demuxer by 1-4 threads, window_bytes 0 disables it
+EXPORT_API int WINAPI ffplay_set_read_ahead(int window_bytes, int threads);
+
+//counts[n] is the number of read-ahead requests that took under 2^n milliseconds, the last bucket holds the rest
+//return the number of buckets written, up to 16
+EXPORT_API int WINAPI ffplay_get_io_latency_histogram(long long *counts, int nb_counts);
+
+//read-ahead buffers reused from earlier files, buffers that had to be allocated, and the most bytes allocated at once;
+//the buffers are freed 30 seconds after the last file read ahead is closed
+EXPORT_API int WINAPI ffplay_get_io_buffer_pool_stats(long long *hits, long long *misses, long long *peak_bytes);
+
+//directory of the keyframe index cache files, NULL for %TEMP%, "" to keep the index in memory only
+EXPORT_API int WINAPI ffplay_set_index_cache_dir(const char *dir);
+
+//index every keyframe of the current file in the background, for containers that seek poorly on their own
+EXPORT_API int WINAPI ffplay_build_keyframe_index();
+
+//seek to the exact requested time, decoding and dropping the frames between the previous keyframe and the target
+EXPORT_API void WINAPI ffplay_set_accurate_seek(int val);
+
+//milliseconds from the last seek request to its first displayed picture, -1 when unknown or still pending
+EXPORT_API double WINAPI ffplay_get_seek_latency();
+
+//times the reader thread woke up from waiting for queue space, a seek or a resume; stays flat while paused
+EXPORT_API int WINAPI ffplay_get_read_wakeups();
+
+//play the audio (stream 1) or subtitles (stream 2) of another file with the next ffplay_start, NULL to use the main file's own
+EXPORT_API int WINAPI ffplay_set_external_input(int stream, const char *url);
+
+//decode steps all players of the process may run at once, and the codec threads they share; 0 for one per core, the default.
+//This is admission control: each decoder keeps its own thread and waits for a step, only the codec threads are fewer
+EXPORT_API int WINAPI ffplay_set_decode_scheduler(int decode_steps, int codec_threads);
+
+//highest quality step the decoder may fall to under load: 1 skip non-ref loop filter, 2 skip loop filter and non-ref idct,
+//3 skip non-ref frames, 4 decode keyframes only; 0 never degrades
+EXPORT_API int WINAPI ffplay_set_decode_quality_max(int level);
+
+//current decode quality step, -1 without video
+EXPORT_API int WINAPI ffplay_get_decode_quality();
+
+//1.play backwards from the current picture, GOP by GOP, with audio muted 0.play forward again from there
+//reversed pictures are shown unfiltered, so -1 while a -vf is set with ffplay_set_vf
+EXPORT_API int WINAPI ffplay_set_reverse(int val);
+
+//fast forward (2 to 32) or rewind (-2 to -32) showing keyframes only, audio muted; 0 plays on normally from there
+EXPORT_API int WINAPI ffplay_set_trick_play(int rate);
+
+//playback speed 0.25 to 4, audio keeps its pitch; above 1 the pictures the display could not show in time are not decoded,
+//and from 3 only keyframes are
+EXPORT_API int WINAPI ffplay_set_speed(double speed);
+
+//decoders kept open between files for the next stream of the same format, 0 to 8, 0 closes them all; 4 by default
+EXPORT_API int WINAPI ffplay_set_codec_pool(int size);
+
+//streams opened with a decoder from the pool so far
+EXPORT_API int WINAPI ffplay_get_codec_pool_hits();
+
+//thumbnails of the keyframes at or before timestamps (milliseconds), scaled to width x height RGBA into out_buffers[i]
+//of width * height * 4 bytes each, decoded in parallel; returns how many were made, failed ones are zeroed, -1 on error
+EXPORT_API int WINAPI ffplay_thumbnails(const char *path, const long long *timestamps, int n, int width, int height, unsigned char **out_buffers);
+
+//thumbnails per second of the last ffplay_thumbnails
+EXPORT_API double WINAPI ffplay_get_thumbnail_rate();
+
+//pictures of pixel format (AVPixelFormat) uploaded to the texture since ffplay_start, with their average and longest upload time
+EXPORT_API int WINAPI ffplay_get_upload_time(int format, double *avg_ms, double *max_ms);
+
+//average texture upload and present (draw without upload) times in ms, and how many pictures were shown from a texture
+//uploaded ahead of their display time; returns the pictures presented, -1 when not playing
+EXPORT_API int WINAPI ffplay_get_render_timings(double *upload_ms, double *present_ms, int *preloaded);
@@ -445,6 +445,7 @@ void print_error_tojson(const char *filename, int err)
 
 typedef struct InputFile {
 	AVFormatContext *fmt_ctx;
+	AVIOContext *mapped_pb;
 
 	InputStream *streams;
 	int       nb_streams;
@@ -470,8 +471,13 @@ static int open_input_file(InputFile *ifile, const char *filename)
 		av_dict_set(&format_opts, "scan_all_pmts", "1", AV_DICT_DONT_OVERWRITE);
 		scan_all_pmts_set = 1;
 	}
+	if (mapped_avio_open(&ifile->mapped_pb, filename) == 0) {
+		fmt_ctx->pb = ifile->mapped_pb;
+		fmt_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+	}
 	if ((err = avformat_open_input(&fmt_ctx, filename,
 		iformat, &format_opts)) < 0) {
+		mapped_avio_close(&ifile->mapped_pb);
 		print_error_tojson(filename, err);
 		return err;
 	}
@@ -598,6 +604,7 @@ static void close_input_file(InputFile *ifile)
 	ifile->nb_streams = 0;
 
 	avformat_close_input(&ifile->fmt_ctx);
+	mapped_avio_close(&ifile->mapped_pb);
 }
 
 #define REALLOCZ_ARRAY_STREAM(ptr, cur_n, new_n)                        \
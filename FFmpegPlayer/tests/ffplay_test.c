@@ -0,0 +1,597 @@
+/*
+ * Checks of ffplay internals that run without a window or an audio device.
+ * ffplay.c is included whole, so its static functions can be called directly.
+ *
+ *   FFmpegPlayerTest queue [packets]
+ *       the packet ring between a producer and a consumer thread: order,
+ *       serials, flushes and abort, and its cost next to the linked-list queue
+ *       it replaced
+ *   FFmpegPlayerTest paused <media file> [players seconds]
+ *       paused players leave their read_thread asleep: no wakeup is counted
+ *       once they settled, the video of every player is decoded, audio is off
+ *   FFmpegPlayerTest subtitle <subtitle file>
+ *       the external reader queues the packets of a subtitle file
+ *   FFmpegPlayerTest convert [width height iterations]
+ *       the row kernels and the sliced plane conversions of upload_texture_planes
+ *       against plain C and swscale, with their throughput
+ *
+ * Every check prints one line and the exit code is the number of failures.
+ */
+
+#include "../ffplay.c"
+#include "libavutil/lfg.h"
+
+#undef main
+
+static AVLFG test_lfg;
+
+/* the linked-list packet queue as it was before the ring, for comparison */
+typedef struct ListPacket {
+	AVPacket pkt;
+	struct ListPacket *next;
+	int serial;
+} ListPacket;
+
+typedef struct ListQueue {
+	ListPacket *first_pkt, *last_pkt;
+	int nb_packets;
+	int size;
+	int64_t duration;
+	int abort_request;
+	int serial;
+	SDL_mutex *mutex;
+	SDL_cond *cond;
+} ListQueue;
+
+static int list_queue_put(ListQueue *q, AVPacket *pkt)
+{
+	ListPacket *pkt1;
+
+	SDL_LockMutex(q->mutex);
+	if (q->abort_request || !(pkt1 = av_malloc(sizeof(ListPacket)))) {
+		SDL_UnlockMutex(q->mutex);
+		return -1;
+	}
+	pkt1->pkt = *pkt;
+	pkt1->next = NULL;
+	if (pkt == &flush_pkt)
+		q->serial++;
+	pkt1->serial = q->serial;
+	if (!q->last_pkt)
+		q->first_pkt = pkt1;
+	else
+		q->last_pkt->next = pkt1;
+	q->last_pkt = pkt1;
+	q->nb_packets++;
+	q->size += pkt1->pkt.size + sizeof(*pkt1);
+	q->duration += pkt1->pkt.duration;
+	SDL_CondSignal(q->cond);
+	SDL_UnlockMutex(q->mutex);
+	return 0;
+}
+
+static int list_queue_get(ListQueue *q, AVPacket *pkt, int *serial)
+{
+	ListPacket *pkt1;
+	int ret = -1;
+
+	SDL_LockMutex(q->mutex);
+	while (!q->abort_request) {
+		if ((pkt1 = q->first_pkt)) {
+			q->first_pkt = pkt1->next;
+			if (!q->first_pkt)
+				q->last_pkt = NULL;
+			q->nb_packets--;
+			q->size -= pkt1->pkt.size + sizeof(*pkt1);
+			q->duration -= pkt1->pkt.duration;
+			*pkt = pkt1->pkt;
+			*serial = pkt1->serial;
+			av_free(pkt1);
+			ret = 1;
+			break;
+		}
+		SDL_CondWait(q->cond, q->mutex);
+	}
+	SDL_UnlockMutex(q->mutex);
+	return ret;
+}
+
+/*
+ * What the consumer of a queue test saw. Packets carry their sequence number
+ * in pts and the number of flushes before them in pos, the last one has
+ * stream_index 1.
+ */
+typedef struct QueueRun {
+	void *queue;
+	int nb_packets;
+	int segment;            /* packets between two flushes, zero for none */
+	int with_payload;
+	int received;
+	int last_segment_received;
+	int errors;
+} QueueRun;
+
+static int queue_test_packet(AVPacket *pkt, QueueRun *run, int i)
+{
+	av_init_packet(pkt);
+	if (run->with_payload) {
+		if (av_new_packet(pkt, 64) < 0)
+			return -1;
+	}
+	else {
+		pkt->data = NULL;
+		pkt->size = 0;
+	}
+	pkt->pts = i;
+	pkt->pos = run->segment ? i / run->segment : 0;
+	pkt->duration = 1;
+	pkt->flags = i % 10 ? 0 : AV_PKT_FLAG_KEY;
+	pkt->stream_index = i == run->nb_packets - 1;
+	return 0;
+}
+
+static int queue_test_last_segment(QueueRun *run)
+{
+	if (!run->segment)
+		return run->nb_packets;
+	return run->nb_packets - (run->nb_packets - 1) / run->segment * run->segment;
+}
+
+/* check one packet against the serial of the last flush packet and the packet before it */
+static int queue_test_check(QueueRun *run, AVPacket *pkt, int serial, int queue_serial, int64_t *last_pts)
+{
+	int last = pkt->stream_index == 1;
+
+	/* packet_queue_start bumps the serial once before the first segment */
+	if (serial != queue_serial || pkt->pos + 1 != serial || pkt->pts <= *last_pts)
+		run->errors++;
+	*last_pts = pkt->pts;
+	run->received++;
+	if (!run->segment || pkt->pos == (run->nb_packets - 1) / run->segment)
+		run->last_segment_received++;
+	av_packet_unref(pkt);
+	return last;
+}
+
+static int ring_consumer(void *arg)
+{
+	QueueRun *run = arg;
+	PacketQueue *q = run->queue;
+	int64_t last_pts = -1;
+	int serial, queue_serial = 0, ret;
+	AVPacket pkt;
+
+	while ((ret = packet_queue_get(q, &pkt, 1, &serial)) > 0) {
+		if (pkt.data == flush_pkt.data) {
+			if (serial <= queue_serial)
+				run->errors++;
+			queue_serial = serial;
+			continue;
+		}
+		if (queue_test_check(run, &pkt, serial, queue_serial, &last_pts))
+			break;
+	}
+	return ret;
+}
+
+static int list_consumer(void *arg)
+{
+	QueueRun *run = arg;
+	int64_t last_pts = -1;
+	int serial, ret;
+	AVPacket pkt;
+
+	while ((ret = list_queue_get(run->queue, &pkt, &serial)) > 0) {
+		if (pkt.data == flush_pkt.data)
+			continue;
+		if (queue_test_check(run, &pkt, serial, serial, &last_pts))
+			break;
+	}
+	return ret;
+}
+
+/* push run->nb_packets through the ring to a consumer thread, flushing after every segment */
+static int64_t ring_run(QueueRun *run, const RetentionWindow *retain, MemoryBudget *mem)
+{
+	PacketQueue q;
+	SDL_Thread *tid;
+	AVPacket pkt;
+	int64_t start;
+	int i;
+
+	if (packet_queue_init(&q, PACKET_QUEUE_SIZE, &buffer_watermarks[0], retain, mem) < 0)
+		return -1;
+	run->queue = &q;
+	packet_queue_start(&q);
+	start = av_gettime_relative();
+	if (!(tid = SDL_CreateThread(ring_consumer, "ring_consumer", run)))
+		return -1;
+	for (i = 0; i < run->nb_packets; i++) {
+		if (run->segment && i && !(i % run->segment)) {
+			packet_queue_flush(&q);
+			packet_queue_put(&q, &flush_pkt);
+		}
+		if (queue_test_packet(&pkt, run, i) < 0 || packet_queue_put(&q, &pkt) < 0)
+			break;
+	}
+	SDL_WaitThread(tid, NULL);
+	start = av_gettime_relative() - start;
+	/* everything handed out, the counters must agree */
+	if (packet_queue_nb_packets(&q) || packet_queue_size(&q) || packet_queue_duration(&q))
+		run->errors++;
+	packet_queue_abort(&q);
+	packet_queue_destroy(&q);
+	return start;
+}
+
+static int64_t list_run(QueueRun *run)
+{
+	ListQueue q = { 0 };
+	ListPacket *pkt1;
+	SDL_Thread *tid;
+	AVPacket pkt;
+	int64_t start;
+	int i;
+
+	if (!(q.mutex = SDL_CreateMutex()) || !(q.cond = SDL_CreateCond()))
+		return -1;
+	run->queue = &q;
+	list_queue_put(&q, &flush_pkt);
+	start = av_gettime_relative();
+	if (!(tid = SDL_CreateThread(list_consumer, "list_consumer", run)))
+		return -1;
+	for (i = 0; i < run->nb_packets; i++) {
+		if (queue_test_packet(&pkt, run, i) < 0 || list_queue_put(&q, &pkt) < 0)
+			break;
+	}
+	SDL_WaitThread(tid, NULL);
+	start = av_gettime_relative() - start;
+	for (; (pkt1 = q.first_pkt); av_free(pkt1))
+		q.first_pkt = pkt1->next;
+	SDL_DestroyMutex(q.mutex);
+	SDL_DestroyCond(q.cond);
+	return start;
+}
+
+static int ring_blocked_get(void *arg)
+{
+	AVPacket pkt;
+	int ret;
+
+	/* the first get hands out the flush packet of packet_queue_start */
+	while ((ret = packet_queue_get(arg, &pkt, 1, NULL)) > 0)
+		;
+	return ret;
+}
+
+static int ring_blocked_put(void *arg)
+{
+	PacketQueue *q = arg;
+	AVPacket pkt;
+	int ret;
+
+	do {
+		av_init_packet(&pkt);
+		pkt.data = NULL;
+		pkt.size = 0;
+	} while ((ret = packet_queue_put(q, &pkt)) >= 0);
+	return ret;
+}
+
+/* a consumer waiting on an empty ring and a producer waiting on a full one both return on abort */
+static int ring_abort_check(int(*fn)(void *), MemoryBudget *mem)
+{
+	RetentionWindow retain = { 0 };
+	PacketQueue q;
+	SDL_Thread *tid;
+	int ret = 0;
+
+	if (packet_queue_init(&q, 64, &buffer_watermarks[0], &retain, mem) < 0)
+		return 0;
+	packet_queue_start(&q);
+	if (!(tid = SDL_CreateThread(fn, "ring_abort", &q)))
+		return 0;
+	SDL_Delay(100);
+	packet_queue_abort(&q);
+	SDL_WaitThread(tid, &ret);
+	packet_queue_destroy(&q);
+	return ret < 0;
+}
+
+static int test_queue(int nb_packets)
+{
+	RetentionWindow no_retain = { 0 }, retain = { 0, 64 * 1024 };
+	MemoryBudget mem = { 0 };
+	QueueRun seek = { NULL, nb_packets / 10, 1000 }, kept = { NULL, nb_packets / 10, 1000, 1 };
+	QueueRun ring = { NULL, nb_packets }, list = { NULL, nb_packets };
+	int64_t t_ring, t_list;
+	int aborts, failed;
+
+	/* every packet of the segment that was never flushed arrives, in order and with its serial */
+	ring_run(&seek, &no_retain, &mem);
+	ring_run(&kept, &retain, &mem);
+	aborts = ring_abort_check(ring_blocked_get, &mem) + ring_abort_check(ring_blocked_put, &mem);
+	t_ring = ring_run(&ring, &no_retain, &mem);
+	t_list = list_run(&list);
+
+	failed = seek.errors || kept.errors || ring.errors || list.errors ||
+		seek.last_segment_received != queue_test_last_segment(&seek) ||
+		kept.last_segment_received != queue_test_last_segment(&kept) ||
+		ring.received != nb_packets || list.received != nb_packets ||
+		aborts != 2 || mem_used(&mem, -1);
+	printf("queue: %s, %d errors, %d of 2 aborts, %"PRId64" bytes left accounted; ns per packet: %.1f ring, %.1f linked list\n",
+		failed ? "FAILED" : "ok", seek.errors + kept.errors + ring.errors + list.errors, aborts, mem_used(&mem, -1),
+		t_ring * 1000.0 / nb_packets, t_list * 1000.0 / nb_packets);
+	return failed;
+}
+
+static int read_wakeups(ReadWake *w)
+{
+	int wakeups;
+
+	SDL_LockMutex(w->mutex);
+	wakeups = w->wakeups;
+	SDL_UnlockMutex(w->mutex);
+	return wakeups;
+}
+
+/* every wait of a paused read_thread is for a signal, so the counts stay where they were */
+static int test_paused_wakeups(const char *url, int nb_players, int seconds)
+{
+	VideoState *players[16];
+	int wakeups[16];
+	int64_t start;
+	int i, opened, grown = 0;
+
+	audio_disable = 1;
+	nb_players = FFMIN(nb_players, FF_ARRAY_ELEMS(players));
+	for (opened = 0; opened < nb_players; opened++)
+		if (!(players[opened] = stream_open(url, NULL)))
+			break;
+
+	/* let every reader open the file and fill its queues before pausing it */
+	start = av_gettime_relative();
+	for (i = 0; i < opened; i++)
+		while (!players[i]->video_st && av_gettime_relative() - start < 5000000)
+			SDL_Delay(10);
+	for (i = 0; i < opened; i++)
+		stream_toggle_pause(players[i]);
+	SDL_Delay(1000);
+
+	for (i = 0; i < opened; i++)
+		wakeups[i] = read_wakeups(&players[i]->continue_read_thread);
+	SDL_Delay(seconds * 1000);
+	for (i = 0; i < opened; i++)
+		grown += read_wakeups(&players[i]->continue_read_thread) - wakeups[i];
+
+	for (i = 0; i < opened; i++) {
+		/* stream_close only closes the current player */
+		cur_video = players[i];
+		stream_close(players[i]);
+	}
+
+	printf("paused: %s, %d read_thread wakeups in %d s over %d of %d paused players\n",
+		opened == nb_players && !grown ? "ok" : "FAILED", grown, seconds, opened, nb_players);
+	return opened != nb_players || grown;
+}
+
+/* the external subtitle reader is started the way read_thread does and must fill subtitleq */
+static int test_external_subtitle(const char *url)
+{
+	VideoState *is;
+	ExternalInput *ext;
+	int64_t start;
+	int nb_packets = 0, ret;
+
+	if (!(is = av_mallocz(sizeof(*is))) || !(is->ic = avformat_alloc_context()))
+		return 1;
+	ext = &is->ext[EXTERNAL_SUBTITLE];
+	is->audio_stream = -1;
+	is->subtitle_stream = EXTERNAL_STREAM_BASE + EXTERNAL_SUBTITLE;
+	if (packet_queue_init(&is->subtitleq, SUBTITLE_PACKET_QUEUE_SIZE, &buffer_watermarks[2], &retention_windows[2], &is->mem) < 0)
+		return 1;
+	packet_queue_start(&is->subtitleq);
+
+	if ((ret = external_input_open(is, ext, AVMEDIA_TYPE_SUBTITLE, url)) < 0) {
+		print_error(url, ret);
+	}
+	else if (!(ext->tid = SDL_CreateThread(external_read_thread, "external_read", ext))) {
+		ret = -1;
+	}
+	else {
+		start = av_gettime_relative();
+		while (!(nb_packets = packet_queue_nb_packets(&is->subtitleq)) && av_gettime_relative() - start < 2000000)
+			SDL_Delay(10);
+	}
+
+	is->abort_request = 1;
+	packet_queue_abort(&is->subtitleq);
+	external_input_close(ext);
+	packet_queue_destroy(&is->subtitleq);
+	avformat_close_input(&is->ic);
+	av_free(is);
+
+	printf("subtitle: %s, %d packets queued from %s\n", nb_packets > 0 ? "ok" : "FAILED", nb_packets, url);
+	return nb_packets <= 0;
+}
+
+/* the row kernels on random samples and odd widths, against the plain C they stand for */
+static int test_row_kernels(void)
+{
+	enum { W = 1923 };
+	uint16_t src16[W];
+	uint8_t dst[W], ref[W];
+	int shift, w, x, failed = 0;
+
+	for (shift = 2; shift <= 8; shift += 6) {
+		for (x = 0; x < W; x++)
+			src16[x] = (av_lfg_get(&test_lfg) & 0x3FF) << (shift - 2);
+		for (w = W - 34; w <= W; w++) {
+			for (x = 0; x < w; x++)
+				ref[x] = src16[x] >> shift;
+			narrow_row(dst, src16, w, shift);
+			failed |= memcmp(dst, ref, w) != 0;
+#if HAVE_AVX2_INTRINSICS
+			if (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) {
+				narrow_row_avx2(dst, src16, w, shift);
+				failed |= memcmp(dst, ref, w) != 0;
+			}
+#endif
+		}
+	}
+	printf("row kernels: %s%s\n", failed ? "FAILED" : "ok",
+		HAVE_AVX2_INTRINSICS && (av_get_cpu_flags() & AV_CPU_FLAG_AVX2) ? "" : " (no AVX2)");
+	return failed;
+}
+
+/* a smooth picture, so swscale's rounding and dithering stay small */
+static void fill_test_frame(AVFrame *frame)
+{
+	const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(frame->format);
+	int nb_planes = av_pix_fmt_count_planes(frame->format);
+	int depth = desc->comp[0].depth, shift = desc->comp[0].shift;
+	int i, x, y;
+
+	for (i = 0; i < nb_planes; i++) {
+		int w = i ? AV_CEIL_RSHIFT(frame->width, desc->log2_chroma_w) : frame->width;
+		int h = i ? AV_CEIL_RSHIFT(frame->height, desc->log2_chroma_h) : frame->height;
+		if (nb_planes == 2 && i)
+			w *= 2;
+		for (y = 0; y < h; y++) {
+			uint8_t *row = frame->data[i] + y * frame->linesize[i];
+			for (x = 0; x < w; x++) {
+				int v = (int)((128 + 96 * sin(x / 37.0 + i) * cos(y / 23.0)) * (1 << (depth - 8)));
+				if (depth > 8)
+					((uint16_t *)row)[x] = v << shift;
+				else
+					row[x] = v;
+			}
+		}
+	}
+}
+
+static int64_t time_planes(PlanesJob *job, int nb_slices, int iterations)
+{
+	int64_t start = av_gettime_relative();
+	int i;
+
+	for (i = 0; i < iterations; i++)
+		convert_pool_execute(&convert_pool, convert_planes_slice, job, nb_slices);
+	return av_gettime_relative() - start;
+}
+
+/*
+ * One format through upload_texture_planes' conversion: cut in slices it must
+ * match the one piece conversion byte for byte, and stay within tolerance of
+ * swscale, which rounds or dithers when narrowing.
+ */
+static int test_planes(enum AVPixelFormat src_fmt, enum AVPixelFormat dst_fmt, int tolerance,
+	int width, int height, int iterations)
+{
+	AVFrame *frame = av_frame_alloc(), *ref = av_frame_alloc();
+	struct SwsContext *sws = NULL;
+	uint8_t *one = NULL, *sliced = NULL;
+	int pitch = FFALIGN(width, 32), size = pitch * FFALIGN(height, 2) * 2;
+	int64_t t_one, t_pool, t_sws;
+	PlanesJob job;
+	int i, x, y, seams = 0, max_diff = 0, failed = 1;
+
+	if (!frame || !ref || !(one = av_mallocz(size)) || !(sliced = av_mallocz(size)))
+		goto end;
+	frame->format = src_fmt;
+	ref->format = dst_fmt;
+	frame->width = ref->width = width;
+	frame->height = ref->height = height;
+	if (av_frame_get_buffer(frame, 32) < 0 || av_frame_get_buffer(ref, 32) < 0)
+		goto end;
+	fill_test_frame(frame);
+	if (!(sws = sws_getContext(width, height, src_fmt, width, height, dst_fmt, sws_flags, NULL, NULL, NULL)))
+		goto end;
+	sws_scale(sws, (const uint8_t * const *)frame->data, frame->linesize, 0, height, ref->data, ref->linesize);
+
+	planes_job_init(&job, frame, one, pitch);
+	convert_planes_slice(&job, 0, 1);
+	planes_job_init(&job, frame, sliced, pitch);
+	for (i = 0; i < 7; i++)
+		convert_planes_slice(&job, i, 7);
+	seams = memcmp(one, sliced, size) != 0;
+
+	for (i = 0; i < job.nb_planes; i++) {
+		PlaneConversion *p = &job.planes[i];
+		for (y = 0; y < p->h; y++) {
+			const uint8_t *a = p->dst + y * p->dst_linesize, *b = ref->data[i] + y * ref->linesize[i];
+			for (x = 0; x < p->w; x++)
+				max_diff = FFMAX(max_diff, abs(a[x] - b[x]));
+		}
+	}
+
+	t_one = time_planes(&job, 1, iterations);
+	t_pool = time_planes(&job, convert_pool_slices(&convert_pool, height), iterations);
+	t_sws = av_gettime_relative();
+	for (i = 0; i < iterations; i++)
+		sws_scale(sws, (const uint8_t * const *)frame->data, frame->linesize, 0, height, ref->data, ref->linesize);
+	t_sws = av_gettime_relative() - t_sws;
+
+	failed = seams || max_diff > tolerance;
+	printf("%s -> %s %dx%d: %s, slices %s, max diff to swscale %d; ms per frame: %.2f one thread, %.2f on %d slices, %.2f swscale\n",
+		av_get_pix_fmt_name(src_fmt), av_get_pix_fmt_name(dst_fmt), width, height, failed ? "FAILED" : "ok",
+		seams ? "differ" : "match", max_diff, t_one / 1000.0 / iterations, t_pool / 1000.0 / iterations,
+		convert_pool_slices(&convert_pool, height), t_sws / 1000.0 / iterations);
+end:
+	sws_freeContext(sws);
+	av_free(one);
+	av_free(sliced);
+	av_frame_free(&frame);
+	av_frame_free(&ref);
+	return failed;
+}
+
+/* 4:4:4 has no texture format, swscale converts it without losing chroma resolution */
+static int test_full_chroma(void)
+{
+	Uint32 sdl_pix_fmt;
+	SDL_BlendMode sdl_blendmode;
+
+	get_sdl_pix_fmt_and_blendmode(AV_PIX_FMT_YUV444P, &sdl_pix_fmt, &sdl_blendmode);
+	printf("yuv444p: %s, %s\n", sdl_pix_fmt == SDL_PIXELFORMAT_UNKNOWN ? "ok" : "FAILED",
+		sdl_pix_fmt == SDL_PIXELFORMAT_UNKNOWN ? "left to swscale" : SDL_GetPixelFormatName(sdl_pix_fmt));
+	return sdl_pix_fmt != SDL_PIXELFORMAT_UNKNOWN;
+}
+
+static int test_convert(int width, int height, int iterations)
+{
+	int failed = test_row_kernels();
+
+	failed += test_full_chroma();
+	failed += test_planes(AV_PIX_FMT_NV12, AV_PIX_FMT_NV12, 0, width, height, iterations);
+	failed += test_planes(AV_PIX_FMT_YUV420P10, AV_PIX_FMT_YUV420P, 2, width, height, iterations);
+	failed += test_planes(AV_PIX_FMT_P010, AV_PIX_FMT_NV12, 2, width, height, iterations);
+	/* odd sizes take the edge paths */
+	failed += test_planes(AV_PIX_FMT_YUV420P10, AV_PIX_FMT_YUV420P, 2, width - 1, height - 1, 1);
+	failed += test_planes(AV_PIX_FMT_P010, AV_PIX_FMT_NV12, 2, width - 2, height - 1, 1);
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	av_init_packet(&flush_pkt);
+	flush_pkt.data = (uint8_t *)&flush_pkt;
+
+	av_lfg_init(&test_lfg, 0x5EED);
+
+	if (argc >= 2 && !strcmp(argv[1], "queue"))
+		return test_queue(argc >= 3 ? FFMAX(atoi(argv[2]), 1000) : 1000000);
+	if (argc >= 3 && !strcmp(argv[1], "paused"))
+		return test_paused_wakeups(argv[2], argc >= 5 ? FFMAX(atoi(argv[3]), 1) : 4, argc >= 5 ? FFMAX(atoi(argv[4]), 1) : 3);
+	if (argc >= 3 && !strcmp(argv[1], "subtitle"))
+		return test_external_subtitle(argv[2]);
+	if (argc >= 2 && !strcmp(argv[1], "convert"))
+		return test_convert(argc >= 4 ? FFMAX(atoi(argv[2]), 64) : 1920, argc >= 4 ? FFMAX(atoi(argv[3]), 64) : 1080,
+			argc >= 5 ? FFMAX(atoi(argv[4]), 1) : 100);
+
+	fprintf(stderr, "usage: %s queue [packets]\n"
+		"       %s paused <media file> [players seconds]\n"
+		"       %s subtitle <subtitle file>\n"
+		"       %s convert [width height iterations]\n", argv[0], argv[0], argv[0], argv[0]);
+	return 1;
+}